@@ -0,0 +1,69 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include "../my_vm.h"
+#include "bench_util.h"
+
+// Measures n_malloc() latency as the virtual address space fills up with a
+// worst-case fragmentation pattern: single used pages separated by single
+// free pages. Every probe asks for a 2-page run, which none of the holes can
+// satisfy, so a linear bitmap scan has to walk the whole fragmented region.
+// The virtual-space search (get_next_avail) is also timed on its own.
+
+#define FILL_STEP   16384   // pages added to the fragmented region per level
+#define FILL_LEVELS 8
+#define PROBES      256
+
+static void *pages[2 * FILL_STEP * FILL_LEVELS];
+
+int main(void) {
+    size_t n = 0;
+
+    // the library initializes itself on the first n_malloc()
+    n_free(n_malloc(PGSIZE), PGSIZE);
+
+    printf("used_pages,fragmented_va_pages,avg_get_next_avail_ns,avg_malloc_ns\n");
+    for (int level = 0; level <= FILL_LEVELS; level++) {
+        uint64_t search_total = 0, total = 0;
+        for (int p = 0; p < PROBES; p++) {
+            uint64_t start = now_ns();
+            get_next_avail(2);
+            search_total += now_ns() - start;
+
+            start = now_ns();
+            void *probe = n_malloc(2 * PGSIZE);
+            total += now_ns() - start;
+
+            if (probe == NULL) {
+                printf("allocation failed at level %d\n", level);
+                return 1;
+            }
+            n_free(probe, 2 * PGSIZE);
+        }
+        printf("%zu,%zu,%" PRIu64 ",%" PRIu64 "\n",
+               n / 2, n, search_total / PROBES, total / PROBES);
+        fflush(stdout);
+
+        if (level == FILL_LEVELS) break;
+
+        // grow the fragmented region: allocate page pairs, free every other page
+        for (int i = 0; i < 2 * FILL_STEP; i++) {
+            pages[n + i] = n_malloc(PGSIZE);
+            if (pages[n + i] == NULL) {
+                printf("fill failed at level %d\n", level);
+                return 1;
+            }
+        }
+        for (int i = 1; i < 2 * FILL_STEP; i += 2) {
+            n_free(pages[n + i], PGSIZE);
+        }
+        n += 2 * FILL_STEP;
+    }
+
+    for (size_t i = 0; i < n; i += 2) {
+        n_free(pages[i], PGSIZE);
+    }
+    return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef BENCH_UTIL_H_INCLUDED
+#define BENCH_UTIL_H_INCLUDED
+
+#include <stdint.h>
+#include <time.h>
+
+// Helpers shared by the benchmarks.
+
+// monotonic wall-clock time in nanoseconds
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+#endif // BENCH_UTIL_H_INCLUDED
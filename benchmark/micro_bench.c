@@ -0,0 +1,413 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../my_vm.h"
+#include "bench_util.h"
+
+// Microbenchmarks for the library's hot paths, each run at 1, 2, 4, ... up
+// to max_threads threads:
+//   - translation on TLB hits and misses (4-byte get_data() over a few pages
+//     that stay cached, and over the pages of a region larger than the TLB,
+//     in random order and in address order for the prefetcher; translate()
+//     itself needs the library's private page directory)
+//   - translation on shared TLB hits: every thread visits one region that
+//     is too large for its L1 TLB but fits the shared TLB, in its own
+//     random order, so the threads read the same TLB sets concurrently
+//   - n_malloc()/n_free() pairs by size class
+//   - n_malloc_small()/n_free_small() pairs for sub-page objects
+//   - put_data()/get_data() bandwidth in 64 KB copies
+//   - gathering one int field from each of 256 records (64-byte records,
+//     and 1 KB ones such as a matrix column), one get_data() per element
+//     and as one get_datav() batch
+//   - mat_mult() on 64x64 matrices
+// Latencies are sampled per batch of operations (a single operation is
+// often shorter than the clock's overhead) and reported as percentiles.
+//
+// usage: ./mbench [max_threads] [csv|json]
+
+#define MAX_THREADS   64
+#define SAMPLES       512     // timed batches per thread and benchmark
+#define HIT_PAGES     16      // fits every thread's L1 TLB
+#define MISS_PAGES    4096    // well beyond the shared TLB's reach
+#define SHARED_PAGES  256     // beyond the L1 TLB, within the shared TLB
+#define COPY_CHUNK    (64 * 1024)
+#define COPY_REGION   (4 * 1024 * 1024)
+#define MAT_SIZE      64
+#define GATHER_N      256     // elements per gather
+#define GATHER_REGION (GATHER_N * 1024)
+
+struct worker;
+
+struct bench {
+    const char *name;
+    unsigned int arg;         // size class, where it applies
+    uint32_t batch;           // operations timed together
+    uint32_t samples;         // batches per thread
+    uint32_t bytes_per_op;    // for bandwidth; 0 if not a copy
+    int (*setup)(struct worker *w);
+    void (*op)(struct worker *w, uint32_t i);
+    void (*teardown)(struct worker *w);
+};
+
+struct worker {
+    pthread_t thread;
+    const struct bench *b;
+    pthread_barrier_t *barrier;
+    char *region;
+    uint32_t region_bytes;
+    char *mats[3];
+    uint32_t *order;          // page visiting order for the miss and shared benchmarks
+    struct vm_iovec *iov;     // one column's elements, for the gathers
+    char *buf;
+    uint64_t *lat;            // per-op latency of each batch, in ns
+    uint64_t start, end;
+    int failed;
+};
+
+// -----------------------------------------------------------------------------
+// Benchmarks
+// -----------------------------------------------------------------------------
+
+static int hit_setup(struct worker *w) {
+    w->region_bytes = HIT_PAGES * PGSIZE;
+    w->region = n_malloc(w->region_bytes);
+    return w->region ? 0 : -1;
+}
+
+static void hit_op(struct worker *w, uint32_t i) {
+    int v;
+    get_data(w->region + (i % HIT_PAGES) * PGSIZE, &v, sizeof(v));
+}
+
+static void region_teardown(struct worker *w) {
+    n_free(w->region, w->region_bytes);
+    free(w->order);
+}
+
+static int miss_setup(struct worker *w) {
+    // lazily backed, so the region is mapped page by page rather than by
+    // superpages that would cover it with four TLB entries
+    w->region_bytes = MISS_PAGES * PGSIZE;
+    w->region = n_malloc_lazy(w->region_bytes);
+    w->order = malloc(MISS_PAGES * sizeof(uint32_t));
+    if (w->region == NULL || w->order == NULL) return -1;
+    int zero = 0;
+    for (uint32_t i = 0; i < MISS_PAGES; i++)
+        put_data(w->region + (size_t)i * PGSIZE, &zero, sizeof(zero));
+
+    // random permutation (xorshift-driven Fisher-Yates), so neither TLB can
+    // follow the access pattern
+    uint32_t x = 2463534242u ^ (uint32_t)(uintptr_t)w;
+    for (uint32_t i = 0; i < MISS_PAGES; i++) w->order[i] = i;
+    for (uint32_t i = MISS_PAGES - 1; i > 0; i--) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        uint32_t j = x % (i + 1);
+        uint32_t t = w->order[i]; w->order[i] = w->order[j]; w->order[j] = t;
+    }
+    return 0;
+}
+
+static void miss_op(struct worker *w, uint32_t i) {
+    int v;
+    get_data(w->region + (size_t)w->order[i % MISS_PAGES] * PGSIZE, &v, sizeof(v));
+}
+
+static char *shared_region;
+static pthread_once_t shared_once = PTHREAD_ONCE_INIT;
+
+static void shared_init(void) {
+    // mapped page by page, like the miss region, and kept for every run
+    shared_region = n_malloc_lazy(SHARED_PAGES * PGSIZE);
+    if (shared_region == NULL) return;
+    int zero = 0;
+    for (uint32_t i = 0; i < SHARED_PAGES; i++)
+        put_data(shared_region + (size_t)i * PGSIZE, &zero, sizeof(zero));
+}
+
+static int shared_setup(struct worker *w) {
+    pthread_once(&shared_once, shared_init);
+    w->order = malloc(SHARED_PAGES * sizeof(uint32_t));
+    if (shared_region == NULL || w->order == NULL) return -1;
+
+    uint32_t x = 2463534242u ^ (uint32_t)(uintptr_t)w;
+    for (uint32_t i = 0; i < SHARED_PAGES; i++) w->order[i] = i;
+    for (uint32_t i = SHARED_PAGES - 1; i > 0; i--) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        uint32_t j = x % (i + 1);
+        uint32_t t = w->order[i]; w->order[i] = w->order[j]; w->order[j] = t;
+    }
+    return 0;
+}
+
+static void shared_op(struct worker *w, uint32_t i) {
+    int v;
+    get_data(shared_region + (size_t)w->order[i % SHARED_PAGES] * PGSIZE, &v, sizeof(v));
+}
+
+static void shared_teardown(struct worker *w) {
+    free(w->order);
+}
+
+static int seq_setup(struct worker *w) {
+    // the miss region, walked in address order instead
+    if (miss_setup(w) != 0) return -1;
+    for (uint32_t i = 0; i < MISS_PAGES; i++) w->order[i] = i;
+    return 0;
+}
+
+static int none_setup(struct worker *w) { (void)w; return 0; }
+static void none_teardown(struct worker *w) { (void)w; }
+
+static void malloc_op(struct worker *w, uint32_t i) {
+    (void)i;
+    void *p = n_malloc(w->b->arg);
+    if (p == NULL) { w->failed = 1; return; }
+    n_free(p, w->b->arg);
+}
+
+static void small_op(struct worker *w, uint32_t i) {
+    (void)i;
+    void *p = n_malloc_small(w->b->arg);
+    if (p == NULL) { w->failed = 1; return; }
+    n_free_small(p);
+}
+
+static int copy_setup(struct worker *w) {
+    w->region_bytes = COPY_REGION;
+    w->region = n_malloc(w->region_bytes);
+    w->buf = malloc(COPY_CHUNK);
+    if (w->region == NULL || w->buf == NULL) return -1;
+    memset(w->buf, 0x5a, COPY_CHUNK);
+
+    // fault everything in, so that the timed copies only move data
+    for (uint32_t off = 0; off < COPY_REGION; off += COPY_CHUNK) {
+        put_data(w->region + off, w->buf, COPY_CHUNK);
+    }
+    return 0;
+}
+
+static void put_op(struct worker *w, uint32_t i) {
+    uint32_t off = (i * COPY_CHUNK) % COPY_REGION;
+    if (put_data(w->region + off, w->buf, COPY_CHUNK) != 0) w->failed = 1;
+}
+
+static void get_op(struct worker *w, uint32_t i) {
+    uint32_t off = (i * COPY_CHUNK) % COPY_REGION;
+    get_data(w->region + off, w->buf, COPY_CHUNK);
+}
+
+static void copy_teardown(struct worker *w) {
+    region_teardown(w);
+    free(w->buf);
+}
+
+static int gather_setup(struct worker *w) {
+    w->region_bytes = GATHER_REGION;
+    w->region = n_malloc(w->region_bytes);
+    w->buf = malloc(GATHER_N * sizeof(int));
+    w->iov = malloc(GATHER_N * sizeof(struct vm_iovec));
+    if (w->region == NULL || w->buf == NULL || w->iov == NULL) return -1;
+
+    int zero = 0;
+    for (uint32_t off = 0; off < w->region_bytes; off += PGSIZE)
+        put_data(w->region + off, &zero, sizeof(zero));
+    return 0;
+}
+
+// field i % 16 of record r, for records of b->arg bytes
+static char *gather_elem(struct worker *w, uint32_t r, uint32_t i) {
+    return w->region + (size_t)r * w->b->arg + (i % 16) * sizeof(int);
+}
+
+static void gather_op(struct worker *w, uint32_t i) {
+    for (uint32_t r = 0; r < GATHER_N; r++)
+        get_data(gather_elem(w, r, i), w->buf + r * sizeof(int), sizeof(int));
+}
+
+static void gatherv_op(struct worker *w, uint32_t i) {
+    for (uint32_t r = 0; r < GATHER_N; r++) {
+        w->iov[r].va = gather_elem(w, r, i);
+        w->iov[r].buf = w->buf + r * sizeof(int);
+        w->iov[r].len = sizeof(int);
+    }
+    if (get_datav(w->iov, GATHER_N) != 0) w->failed = 1;
+}
+
+static void gather_teardown(struct worker *w) {
+    copy_teardown(w);
+    free(w->iov);
+}
+
+static int mat_setup(struct worker *w) {
+    uint32_t bytes = MAT_SIZE * MAT_SIZE * sizeof(int);
+    for (int m = 0; m < 3; m++) {
+        w->mats[m] = n_malloc(bytes);
+        if (w->mats[m] == NULL) return -1;
+    }
+    for (int i = 0; i < MAT_SIZE * MAT_SIZE; i++) {
+        int v = i % 7;
+        put_data(w->mats[0] + i * sizeof(int), &v, sizeof(int));
+        put_data(w->mats[1] + i * sizeof(int), &v, sizeof(int));
+    }
+    return 0;
+}
+
+static void mat_op(struct worker *w, uint32_t i) {
+    (void)i;
+    mat_mult(w->mats[0], w->mats[1], MAT_SIZE, w->mats[2]);
+}
+
+static void mat_teardown(struct worker *w) {
+    for (int m = 0; m < 3; m++) n_free(w->mats[m], MAT_SIZE * MAT_SIZE * sizeof(int));
+}
+
+static const struct bench benches[] = {
+    { "translate_hit",    0,               256, SAMPLES, 0, hit_setup,  hit_op,    region_teardown },
+    { "translate_miss",   0,               256, SAMPLES, 0, miss_setup, miss_op,   region_teardown },
+    { "translate_seq",    0,               256, SAMPLES, 0, seq_setup,  miss_op,   region_teardown },
+    { "translate_shared", 0,               256, SAMPLES, 0, shared_setup, shared_op, shared_teardown },
+    { "malloc_free_64",   64,              64,  SAMPLES, 0, none_setup, malloc_op, none_teardown },
+    { "malloc_free_4k",   4096,            64,  SAMPLES, 0, none_setup, malloc_op, none_teardown },
+    { "malloc_free_64k",  64 * 1024,       16,  SAMPLES, 0, none_setup, malloc_op, none_teardown },
+    { "malloc_free_1m",   1024 * 1024,     4,   128,     0, none_setup, malloc_op, none_teardown },
+    { "malloc_free_4m",   4 * 1024 * 1024, 4,   128,     0, none_setup, malloc_op, none_teardown },
+    { "small_free_16",    16,              256, SAMPLES, 0, none_setup, small_op,  none_teardown },
+    { "small_free_256",   256,             256, SAMPLES, 0, none_setup, small_op,  none_teardown },
+    { "put_data_64k",     0,               4,   SAMPLES, COPY_CHUNK, copy_setup, put_op, copy_teardown },
+    { "get_data_64k",     0,               4,   SAMPLES, COPY_CHUNK, copy_setup, get_op, copy_teardown },
+    { "gather_64",        64,              4,   SAMPLES, GATHER_N * sizeof(int), gather_setup, gather_op,  gather_teardown },
+    { "gatherv_64",       64,              4,   SAMPLES, GATHER_N * sizeof(int), gather_setup, gatherv_op, gather_teardown },
+    { "gather_1k",        1024,            4,   SAMPLES, GATHER_N * sizeof(int), gather_setup, gather_op,  gather_teardown },
+    { "gatherv_1k",       1024,            4,   SAMPLES, GATHER_N * sizeof(int), gather_setup, gatherv_op, gather_teardown },
+    { "mat_mult_64",      MAT_SIZE,        1,   32,      0, mat_setup,  mat_op,    mat_teardown },
+};
+
+// -----------------------------------------------------------------------------
+// Driver
+// -----------------------------------------------------------------------------
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    const struct bench *b = w->b;
+
+    if (b->setup(w) != 0) w->failed = 1;
+    pthread_barrier_wait(w->barrier);
+
+    w->start = now_ns();
+    uint32_t i = 0;
+    for (uint32_t s = 0; s < b->samples && !w->failed; s++) {
+        uint64_t t0 = now_ns();
+        for (uint32_t k = 0; k < b->batch; k++) b->op(w, i++);
+        w->lat[s] = (now_ns() - t0) / b->batch;
+    }
+    w->end = now_ns();
+
+    pthread_barrier_wait(w->barrier);
+    b->teardown(w);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static bool json;
+static bool first_row = true;
+
+static int run(const struct bench *b, int nthreads) {
+    static struct worker workers[MAX_THREADS];
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, nthreads);
+
+    uint64_t *lat = calloc((size_t)nthreads * b->samples, sizeof(uint64_t));
+    if (lat == NULL) return -1;
+
+    struct vm_stats before, after;
+    vm_get_stats(&before);
+
+    for (int t = 0; t < nthreads; t++) {
+        memset(&workers[t], 0, sizeof(workers[t]));
+        workers[t].b = b;
+        workers[t].barrier = &barrier;
+        workers[t].lat = lat + (size_t)t * b->samples;
+        pthread_create(&workers[t].thread, NULL, worker_main, &workers[t]);
+    }
+
+    uint64_t start = UINT64_MAX, end = 0;
+    int failed = 0;
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        if (workers[t].start < start) start = workers[t].start;
+        if (workers[t].end > end) end = workers[t].end;
+        failed |= workers[t].failed;
+    }
+    pthread_barrier_destroy(&barrier);
+    vm_get_stats(&after);
+
+    if (failed) {
+        fprintf(stderr, "%s: failed with %d threads\n", b->name, nthreads);
+        free(lat);
+        return -1;
+    }
+
+    size_t n = (size_t)nthreads * b->samples;
+    qsort(lat, n, sizeof(uint64_t), cmp_u64);
+
+    double secs = (end - start) / 1e9;
+    uint64_t ops = (uint64_t)n * b->batch;
+    double ops_per_sec = ops / secs;
+    double mb_per_sec = (double)ops * b->bytes_per_op / secs / (1024.0 * 1024.0);
+    unsigned long long lookups = after.tlb_lookups - before.tlb_lookups;
+    double miss_pct = lookups ? 100.0 * (after.tlb_misses - before.tlb_misses) / lookups : 0.0;
+
+    if (json) {
+        printf("%s  {\"bench\": \"%s\", \"threads\": %d, \"ops\": %" PRIu64 ", "
+               "\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.1f, "
+               "\"p50_ns\": %" PRIu64 ", \"p90_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64 ", "
+               "\"tlb_miss_pct\": %.2f}",
+               first_row ? "" : ",\n", b->name, nthreads, ops, secs, ops_per_sec,
+               mb_per_sec, lat[n / 2], lat[n * 9 / 10], lat[n * 99 / 100], miss_pct);
+    } else {
+        printf("%s,%d,%" PRIu64 ",%.6f,%.1f,%.1f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.2f\n",
+               b->name, nthreads, ops, secs, ops_per_sec, mb_per_sec,
+               lat[n / 2], lat[n * 9 / 10], lat[n * 99 / 100], miss_pct);
+    }
+    first_row = false;
+    fflush(stdout);
+
+    free(lat);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = (ncpu > 8) ? 8 : (int)ncpu;
+    if (argc > 1) max_threads = atoi(argv[1]);
+    if (max_threads < 1) max_threads = 1;
+    if (max_threads > MAX_THREADS) max_threads = MAX_THREADS;
+    json = (argc > 2 && strcmp(argv[2], "json") == 0);
+
+    if (json) {
+        printf("[\n");
+    } else {
+        printf("bench,threads,ops,seconds,ops_per_sec,mb_per_sec,p50_ns,p90_ns,p99_ns,tlb_miss_pct\n");
+    }
+
+    int status = 0;
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        // 1, 2, 4, ... and finally max_threads itself
+        for (int t = 1; ; t = (t * 2 > max_threads) ? max_threads : t * 2) {
+            if (run(&benches[i], t) != 0) status = 1;
+            if (t == max_threads) break;
+        }
+    }
+
+    if (json) printf("\n]\n");
+    return status;
+}
@@ -0,0 +1,153 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../my_vm.h"
+#include "bench_util.h"
+
+// Compares page sizes on the same workloads. The layout is fixed once per
+// process, so every page size runs in its own child, started with vm_init():
+//   - stream_get_4b: 4-byte get_data() every 64 bytes through a STREAM_BYTES
+//     buffer, in address order
+//   - random_get_4b: 4-byte get_data() at random offsets of the same buffer
+//   - stream_copy_64k: get_data() of whole 64 KB chunks through it
+//   - malloc_touch_64: n_malloc(64) plus one write, the way an application
+//     without a small-object allocator would use it; mem_kb is the physical
+//     memory that ALLOC_N such objects hold
+//   - small_touch_64: the same with n_malloc_small()
+// The buffer is built from 1 MB allocations, below the superpage threshold
+// of every layout, so it is mapped with pages of the size under test.
+//
+// usage: ./pbench [pgsize ...]   (default: 4096 16384 65536)
+
+#define STREAM_BYTES  (16u * 1024 * 1024)
+#define STREAM_CHUNK  (1024u * 1024)
+#define STREAM_PASSES 4
+#define RANDOM_OPS    (1u << 20)
+#define COPY_CHUNK    (64u * 1024)
+#define ALLOC_N       4096
+
+static char *chunks[STREAM_BYTES / STREAM_CHUNK];
+static void *objs[ALLOC_N];
+static char copy_buf[COPY_CHUNK];
+
+static inline char *stream_addr(uint32_t off) {
+    return chunks[off / STREAM_CHUNK] + off % STREAM_CHUNK;
+}
+
+static unsigned long long tlb_misses(void) {
+    struct vm_stats st;
+    vm_get_stats(&st);
+    return st.tlb_misses;
+}
+
+static unsigned long long tlb_lookups(void) {
+    struct vm_stats st;
+    vm_get_stats(&st);
+    return st.tlb_lookups;
+}
+
+static void row(uint32_t pgsize, const char *bench, uint64_t ns, uint64_t ops,
+                unsigned long long lookups, unsigned long long misses, uint64_t mem_kb) {
+    printf("%u,%s,%.1f,%.2f,%llu\n", pgsize / 1024, bench, (double)ns / ops,
+           lookups ? 100.0 * misses / lookups : 0.0, (unsigned long long)mem_kb);
+}
+
+// one workload over the stream buffer: ops accesses, TLB counters bracketed
+#define TIMED(pgsize, name, ops, body)                                   \
+    do {                                                                 \
+        unsigned long long l0 = tlb_lookups(), m0 = tlb_misses();        \
+        uint64_t t0 = now_ns();                                          \
+        body;                                                            \
+        uint64_t t1 = now_ns();                                          \
+        row(pgsize, name, t1 - t0, ops, tlb_lookups() - l0,              \
+            tlb_misses() - m0, 0);                                       \
+    } while (0)
+
+static uint64_t frames_kb(void) {
+    struct vm_stats st;
+    vm_get_stats(&st);
+    return (uint64_t)st.frames_used * PGSIZE / 1024;
+}
+
+static int run_child(uint32_t pgsize) {
+    struct vm_config config = { .pgsize = pgsize };
+    if (vm_init(&config) != 0) {
+        fprintf(stderr, "vm_init rejected page size %u\n", pgsize);
+        return 1;
+    }
+
+    for (uint32_t c = 0; c < STREAM_BYTES / STREAM_CHUNK; c++) {
+        chunks[c] = n_malloc(STREAM_CHUNK);
+        if (chunks[c] == NULL) return 1;
+        for (uint32_t off = 0; off < STREAM_CHUNK; off += COPY_CHUNK)
+            put_data(chunks[c] + off, copy_buf, COPY_CHUNK);
+    }
+
+    int v = 0;
+    uint64_t stream_ops = (uint64_t)STREAM_PASSES * (STREAM_BYTES / 64);
+    TIMED(pgsize, "stream_get_4b", stream_ops,
+          for (uint32_t p = 0; p < STREAM_PASSES; p++)
+              for (uint32_t off = 0; off < STREAM_BYTES; off += 64)
+                  get_data(stream_addr(off), &v, sizeof(v)));
+
+    uint32_t x = 1;
+    TIMED(pgsize, "random_get_4b", RANDOM_OPS,
+          for (uint32_t i = 0; i < RANDOM_OPS; i++) {
+              x = x * 1103515245u + 12345u;
+              get_data(stream_addr((x >> 4) % (STREAM_BYTES / 4) * 4), &v, sizeof(v));
+          });
+
+    uint64_t copy_ops = (uint64_t)STREAM_PASSES * (STREAM_BYTES / COPY_CHUNK);
+    TIMED(pgsize, "stream_copy_64k", copy_ops,
+          for (uint32_t p = 0; p < STREAM_PASSES; p++)
+              for (uint32_t off = 0; off < STREAM_BYTES; off += COPY_CHUNK)
+                  get_data(stream_addr(off), copy_buf, COPY_CHUNK));
+
+    for (int small = 0; small < 2; small++) {
+        uint64_t base_kb = frames_kb();
+        uint64_t t0 = now_ns();
+        for (int i = 0; i < ALLOC_N; i++) {
+            objs[i] = small ? n_malloc_small(64) : n_malloc(64);
+            if (objs[i] == NULL) return 1;
+            put_data(objs[i], &i, sizeof(i));
+        }
+        uint64_t t1 = now_ns();
+        uint64_t mem_kb = frames_kb() - base_kb;
+        for (int i = 0; i < ALLOC_N; i++) {
+            if (small) n_free_small(objs[i]);
+            else n_free(objs[i], 64);
+        }
+        row(pgsize, small ? "small_touch_64" : "malloc_touch_64", t1 - t0, ALLOC_N,
+            0, 0, mem_kb);
+    }
+    fflush(stdout);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    uint32_t defaults[] = { 4096, 16384, 65536 };
+    int n = (argc > 1) ? argc - 1 : (int)(sizeof(defaults) / sizeof(defaults[0]));
+
+    printf("pgsize_kb,bench,ns_per_op,tlb_miss_pct,mem_kb\n");
+    fflush(stdout);
+
+    int status = 0;
+    for (int i = 0; i < n; i++) {
+        uint32_t pgsize = (argc > 1) ? (uint32_t)strtoul(argv[i + 1], NULL, 0) : defaults[i];
+        pid_t pid = fork();
+        if (pid < 0) { perror("fork"); return 1; }
+        if (pid == 0) exit(run_child(pgsize));
+
+        int child;
+        waitpid(pid, &child, 0);
+        if (!WIFEXITED(child) || WEXITSTATUS(child) != 0) {
+            printf("%u,failed\n", pgsize / 1024);
+            status = 1;
+        }
+    }
+    return status;
+}
@@ -0,0 +1,95 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../my_vm.h"
+#include "bench_util.h"
+
+// Measures library startup. Every run happens in a fresh child process so the
+// pool and metadata mappings really are new, and reports the median of RUNS:
+//   init_us        - vm_init() (0 for the lazy path, which has no init call)
+//   first_alloc_us - the first n_malloc() (this is where lazy init happens)
+//   first_touch_us - writing TOUCH_BYTES of freshly allocated memory after
+//                    IDLE_MS of other startup work, which is what prefaulting
+//                    overlaps with
+// All three are independent of MEMSIZE; only first_touch_us depends on how
+// much of the pool has been faulted in.
+
+#define RUNS        15
+#define TOUCH_BYTES (16u * 1024 * 1024)
+#define IDLE_MS     50
+
+enum mode { LAZY, INIT, INIT_PREFAULT };
+static const char *mode_names[] = { "lazy", "vm_init", "vm_init_prefault" };
+
+static void run_child(enum mode m, int fd) {
+    uint64_t t[3] = { 0, 0, 0 };
+    struct vm_config config = { .prefault = (m == INIT_PREFAULT) };
+
+    uint64_t start = now_ns();
+    if (m != LAZY && vm_init(&config) != 0) exit(1);
+    t[0] = now_ns() - start;
+
+    start = now_ns();
+    void *va = n_malloc(TOUCH_BYTES);
+    t[1] = now_ns() - start;
+    if (va == NULL) exit(1);
+
+    struct timespec idle = { 0, IDLE_MS * 1000000L };
+    nanosleep(&idle, NULL);
+
+    static char buf[MAX_PGSIZE];
+    memset(buf, 0xab, sizeof(buf));
+    start = now_ns();
+    for (uint32_t off = 0; off < TOUCH_BYTES; off += PGSIZE)
+        put_data((char *)va + off, buf, PGSIZE);
+    t[2] = now_ns() - start;
+
+    if (write(fd, t, sizeof(t)) != sizeof(t)) exit(1);
+    exit(0);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+int main(void) {
+    printf("mode,init_us,first_alloc_us,first_touch_us\n");
+    fflush(stdout);
+    for (int m = LAZY; m <= INIT_PREFAULT; m++) {
+        uint64_t samples[3][RUNS];
+        for (int r = 0; r < RUNS; r++) {
+            int fds[2];
+            if (pipe(fds) != 0) { perror("pipe"); return 1; }
+            pid_t pid = fork();
+            if (pid < 0) { perror("fork"); return 1; }
+            if (pid == 0) {
+                close(fds[0]);
+                run_child((enum mode)m, fds[1]);
+            }
+            close(fds[1]);
+
+            uint64_t t[3];
+            int status;
+            ssize_t got = read(fds[0], t, sizeof(t));
+            close(fds[0]);
+            waitpid(pid, &status, 0);
+            if (got != sizeof(t) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                printf("%s run %d failed\n", mode_names[m], r);
+                return 1;
+            }
+            for (int i = 0; i < 3; i++) samples[i][r] = t[i];
+        }
+        for (int i = 0; i < 3; i++) qsort(samples[i], RUNS, sizeof(uint64_t), cmp_u64);
+        printf("%s,%.1f,%.1f,%.1f\n", mode_names[m],
+               samples[0][RUNS / 2] / 1e3, samples[1][RUNS / 2] / 1e3,
+               samples[2][RUNS / 2] / 1e3);
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -3,10 +3,12 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <time.h>
 #include "../my_vm.h"
 
 #define SIZE 1000
 #define ARRAY_SIZE 400
+#define BENCH_SIZE 200
 
 static inline uint32_t add_offset32(void *base_va, size_t off_bytes) {
     uint32_t base = VA2U(base_va);        // 32-bit simulated VA
@@ -14,6 +16,28 @@ static inline uint32_t add_offset32(void *base_va, size_t off_bytes) {
     return base + off;
 }
 
+// the element-at-a-time kernel mat_mult() used to be: two get_data() calls
+// and one translation per multiply. kept here as the speedup baseline.
+static void mat_mult_ref(void *mat1, void *mat2, int size, void *answer) {
+    for (int i = 0; i < size; i++) {
+        for (int j = 0; j < size; j++) {
+            uint32_t a, b, c = 0;
+            for (int k = 0; k < size; k++) {
+                get_data(U2VA(add_offset32(mat1, ((size_t)i * size + k) * sizeof(int))), &a, sizeof(int));
+                get_data(U2VA(add_offset32(mat2, ((size_t)k * size + j) * sizeof(int))), &b, sizeof(int));
+                c += a * b;
+            }
+            put_data(U2VA(add_offset32(answer, ((size_t)i * size + j) * sizeof(int))), &c, sizeof(int));
+        }
+    }
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 int main(void) {
 
     printf("Allocating three arrays of %d bytes\n", ARRAY_SIZE);
@@ -81,6 +105,39 @@ int main(void) {
     n_free(a, ARRAY_SIZE);
 
     print_TLB_missrate();
+
+    printf("Timing mat_mult() against the element-wise kernel (%dx%d)\n", BENCH_SIZE, BENCH_SIZE);
+    size_t bytes = (size_t)BENCH_SIZE * BENCH_SIZE * sizeof(int);
+    void *p = n_malloc(bytes), *q = n_malloc(bytes);
+    void *ref = n_malloc(bytes), *res = n_malloc(bytes);
+
+    for (i = 0; i < BENCH_SIZE * BENCH_SIZE; i++) {
+        y = (i * 7) % 13;
+        z = (i * 5) % 11 - 5;
+        put_data(U2VA(add_offset32(p, (size_t)i * sizeof(int))), &y, sizeof(int));
+        put_data(U2VA(add_offset32(q, (size_t)i * sizeof(int))), &z, sizeof(int));
+    }
+
+    double t0 = now_sec();
+    mat_mult_ref(p, q, BENCH_SIZE, ref);
+    double t1 = now_sec();
+    mat_mult(p, q, BENCH_SIZE, res);
+    double t2 = now_sec();
+
+    int mismatches = 0;
+    for (i = 0; i < BENCH_SIZE * BENCH_SIZE; i++) {
+        get_data(U2VA(add_offset32(ref, (size_t)i * sizeof(int))), &y, sizeof(int));
+        get_data(U2VA(add_offset32(res, (size_t)i * sizeof(int))), &z, sizeof(int));
+        mismatches += (y != z);
+    }
+    printf("element-wise: %.4f s, mat_mult: %.4f s, speedup: %.1fx, %s\n",
+           t1 - t0, t2 - t1, (t1 - t0) / (t2 - t1),
+           mismatches ? "results differ" : "results match");
+
+    n_free(p, bytes);
+    n_free(q, bytes);
+    n_free(ref, bytes);
+    n_free(res, bytes);
     
     return 0;
 }
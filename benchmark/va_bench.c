@@ -0,0 +1,102 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "../my_vm.h"
+#include "bench_util.h"
+
+// Measures the address width the library was built with (make VA_BITS=48 for
+// 48-bit addresses, in both directories):
+//   - sparse_reserve: n_malloc_lazy() of RESERVE_CHUNK regions until
+//     HEAP_BYTES are reserved or the heap runs out; heap_mb is what fit
+//   - sparse_touch: one 4-byte put_data() every TOUCH_STRIDE bytes of that
+//     heap, which backs one page each; pt_kb is the page-table memory behind
+//     the whole heap (frames in use minus the touched pages)
+//   - random_get_4b: 4-byte get_data() at random touched pages, which mostly
+//     miss the TLB and so time a full page-table walk
+//   - small_space: a new address space holding one SMALL_BYTES allocation;
+//     pt_kb is its page-table memory
+//
+// usage: ./vbench [heap_mb]   (default: 8192)
+
+#define RESERVE_CHUNK (256u * 1024 * 1024)
+#define TOUCH_STRIDE  (1024u * 1024)
+#define RANDOM_OPS    (1u << 20)
+#define SMALL_BYTES   (1024u * 1024)
+#define MAX_CHUNKS    4096
+
+static char *chunks[MAX_CHUNKS];
+
+static uint64_t frames_used(void) {
+    struct vm_stats st;
+    vm_get_stats(&st);
+    return st.frames_used;
+}
+
+static void row(const char *bench, uint64_t heap_mb, uint64_t ns, uint64_t ops, uint64_t pt_kb) {
+    printf("%u,%s,%llu,%.1f,%llu\n", (unsigned)VA_BITS, bench, (unsigned long long)heap_mb,
+           ops ? (double)ns / ops : 0.0, (unsigned long long)pt_kb);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    uint64_t heap_bytes = (argc > 1) ? strtoull(argv[1], NULL, 0) << 20 : 8192ull << 20;
+    if (vm_init(NULL) != 0) return 1;
+
+    printf("va_bits,bench,heap_mb,ns_per_op,pt_kb\n");
+
+    uint32_t n = 0;
+    uint64_t t0 = now_ns();
+    while (n < MAX_CHUNKS && (uint64_t)n * RESERVE_CHUNK < heap_bytes) {
+        chunks[n] = n_malloc_lazy(RESERVE_CHUNK);
+        if (chunks[n] == NULL) break;
+        n++;
+    }
+    uint64_t t1 = now_ns();
+    uint64_t heap_mb = (uint64_t)n * (RESERVE_CHUNK >> 20);
+    row("sparse_reserve", heap_mb, t1 - t0, n, 0);
+    if (n == 0) return 1;
+
+    uint32_t per_chunk = RESERVE_CHUNK / TOUCH_STRIDE;
+    uint64_t touches = (uint64_t)n * per_chunk;
+    uint64_t base_frames = frames_used();
+    t0 = now_ns();
+    for (uint32_t c = 0; c < n; c++) {
+        for (uint32_t i = 0; i < per_chunk; i++) {
+            if (put_data(chunks[c] + (uint64_t)i * TOUCH_STRIDE, &i, sizeof(i)) != 0) return 1;
+        }
+    }
+    t1 = now_ns();
+    uint64_t pt_frames = frames_used() - base_frames - touches;
+    row("sparse_touch", heap_mb, t1 - t0, touches, pt_frames * PGSIZE / 1024);
+
+    uint32_t x = 1, v = 0, bad = 0;
+    t0 = now_ns();
+    for (uint32_t op = 0; op < RANDOM_OPS; op++) {
+        x = x * 1103515245u + 12345u;
+        uint64_t page = (x >> 4) % touches;
+        get_data(chunks[page / per_chunk] + (page % per_chunk) * TOUCH_STRIDE, &v, sizeof(v));
+        bad += (v != page % per_chunk);
+    }
+    t1 = now_ns();
+    row("random_get_4b", heap_mb, t1 - t0, RANDOM_OPS, 0);
+    if (bad != 0) {
+        fprintf(stderr, "random_get_4b read %u wrong values\n", bad);
+        return 1;
+    }
+
+    base_frames = frames_used();
+    t0 = now_ns();
+    struct vm_space *space = vm_space_create();
+    if (space == NULL) return 1;
+    struct vm_space *prev = vm_space_switch(space);
+    if (n_malloc(SMALL_BYTES) == NULL) return 1;
+    t1 = now_ns();
+    uint64_t data_frames = SMALL_BYTES / PGSIZE;
+    pt_frames = frames_used() - base_frames - data_frames;
+    row("small_space", SMALL_BYTES >> 20, t1 - t0, 1, pt_frames * PGSIZE / 1024);
+    vm_space_switch(prev);
+    vm_space_destroy(space);
+    return 0;
+}
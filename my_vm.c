@@ -1,30 +1,351 @@
 #include "my_vm.h"
 #include <string.h>   // optional for memcpy if you later implement put/get
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <limits.h>
 
 // -----------------------------------------------------------------------------
 // Global Declarations (optional)
 // -----------------------------------------------------------------------------
 
+// the default layout; vm_init() may replace it before memory is set up
+#define DEFAULT_OFFSET_BITS  __builtin_ctz(DEFAULT_PGSIZE)
+#if VA_BITS == 32
+#define DEFAULT_PDX_BITS     ((32 - DEFAULT_OFFSET_BITS) / 2)
+#define DEFAULT_PTX_BITS     (32 - DEFAULT_OFFSET_BITS - DEFAULT_PDX_BITS)
+#else
+#define DEFAULT_PDX_BITS     (DEFAULT_OFFSET_BITS - 3)
+#define DEFAULT_PTX_BITS     DEFAULT_PDX_BITS
+#define DEFAULT_UPPER_BITS   (48 - DEFAULT_OFFSET_BITS - 2 * DEFAULT_PTX_BITS)
+#define DEFAULT_P4_BITS      (DEFAULT_UPPER_BITS / 2)
+#define DEFAULT_P3_BITS      (DEFAULT_UPPER_BITS - DEFAULT_P4_BITS)
+#endif
+#define DEFAULT_TLB_SETS     (DEFAULT_TLB_ENTRIES / TLB_WAYS)
+
+struct vm_layout vm_layout = {
+  .pgsize = DEFAULT_PGSIZE,
+  .offset_bits = DEFAULT_OFFSET_BITS,
+  .pdx_bits = DEFAULT_PDX_BITS,
+  .ptx_bits = DEFAULT_PTX_BITS,
+  .pdx_shift = DEFAULT_OFFSET_BITS + DEFAULT_PTX_BITS,
+  .off_mask = DEFAULT_PGSIZE - 1,
+  .ptx_mask = (1u << DEFAULT_PTX_BITS) - 1,
+  .num_frames = (uint32_t)(DEFAULT_MEMSIZE / DEFAULT_PGSIZE),
+  .memsize = DEFAULT_MEMSIZE,
+  .tlb_entries = DEFAULT_TLB_ENTRIES,
+  .tlb_sets = DEFAULT_TLB_SETS,
+  .tlb_set_bits = __builtin_ctz(DEFAULT_TLB_SETS),
+  .pdx_mask = (1u << DEFAULT_PDX_BITS) - 1,
+#if VA_BITS == 48
+  .p3_shift = DEFAULT_OFFSET_BITS + DEFAULT_PTX_BITS + DEFAULT_PDX_BITS,
+  .p3_mask = (1u << DEFAULT_P3_BITS) - 1,
+  .p4_shift = 48 - DEFAULT_P4_BITS,
+  .p4_bits = DEFAULT_P4_BITS,
+#endif
+};
+
 struct tlb tlb_store; // Placeholder for your TLB structure
 
-// Optional counters for TLB statistics
-static unsigned long long tlb_lookups = 0;
-static unsigned long long tlb_misses  = 0;
+// per-thread statistics shard. only its own thread writes it, with plain
+// (relaxed) stores, so counting adds no shared cache-line traffic; a shard
+// is linked into stat_shards when its thread registers, and vm_get_stats()
+// sums the live shards plus the totals folded in by exited threads.
+struct stat_shard {
+  unsigned long long l1_hits;
+  unsigned long long tlb_hits;
+  unsigned long long tlb_misses;
+  unsigned long long tlb_evictions;
+  unsigned long long tlb_prefetches;
+  unsigned long long tlb_prefetch_hits;
+  unsigned long long pgtbl_walks;
+  unsigned long long bytes_read;
+  unsigned long long bytes_written;
+  uint32_t* mag_count;    // the thread's frame magazine fill
+  struct stat_shard* next;
+  struct stat_shard** pprev;
+};
+
+static __thread struct stat_shard stat_shard;
+static struct stat_shard* stat_shards = NULL;
+static struct stat_shard stat_retired;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define STAT_ADD(field, n) \
+  __atomic_store_n(&stat_shard.field, stat_shard.field + (n), __ATOMIC_RELAXED)
+
+// per-thread private L1 TLB. entries are valid for the shootdown generation
+// stored in gen; a thread that observes a newer tlb_gen drops its whole L1.
+struct l1_tlb {
+  vaddr_t vpn[L1_TLB_ENTRIES];
+  uint16_t asid[L1_TLB_ENTRIES];
+  pte_t* pte[L1_TLB_ENTRIES];
+  uint64_t gen;
+};
+
+static __thread struct l1_tlb l1_tlb;
+static uint64_t tlb_gen = 0;
+
+// per-thread magazine of frames already reserved in p_bmap. alloc_frame()
+// pops from it and free_frame() pushes to it without any lock; only refills
+// and drains of FRAME_MAG_BATCH frames touch p_bmap under frame_lock.
+struct frame_mag {
+  uint32_t frames[FRAME_MAG_SIZE];
+  uint32_t count;
+};
+
+static __thread struct frame_mag frame_mag;
+
+// threads that cache shared state register a destructor on first use, so
+// their pending counters and magazines are handed back when they exit
+static __thread bool thread_registered;
+static pthread_key_t vm_thread_key;
+static pthread_once_t vm_thread_key_once = PTHREAD_ONCE_INIT;
 
 static void* p_buff;
 static void* p_bmap;
-static void* v_bmap;
 
-static pde_t* pgdir = NULL;
+// free-extent tree over the 64-bit words of v_bmap (a segment tree in heap
+// layout: node 1 is the root, leaves are nodes V_BMAP_WORDS + w). every node
+// records the free run touching its left edge (prefix), its right edge
+// (suffix) and the longest free run anywhere inside it (best), in pages. a
+// run of num_pages free pages is then found in O(log) steps regardless of
+// how fragmented the address space is. each value is stored as its shortfall
+// from the node's span, so zeroed memory is a tree of a free address space:
+// a new space only touches the nodes its first allocations change.
+#define NUM_VPAGES     ((uint32_t)(MAX_MEMSIZE >> OFFSET_BITS))
+#define V_BMAP_WORDS   (NUM_VPAGES / 64)
+#define MAX_V_BMAP_WORDS ((uint32_t)(MAX_MEMSIZE / MIN_PGSIZE / 64))
+
+struct extent_tree {
+  uint32_t prefix[2 * MAX_V_BMAP_WORDS];
+  uint32_t suffix[2 * MAX_V_BMAP_WORDS];
+  uint32_t best[2 * MAX_V_BMAP_WORDS];
+};
+
+// an address space: a page directory plus the v_bmap and extent tree of its
+// virtual pages. each thread runs in one space at a time (cur_space, much
+// like a CPU's CR3) and starts in root_space, whose pgdir sits at frame 0.
+// spaces[] maps an ASID back to its space for swap_out(); it is guarded by
+// swap_lock.
+struct vm_space {
+  pde_t* pgdir;
+  uint64_t* v_bmap;
+  struct extent_tree* v_tree;
+  uint32_t vpages_used;  // pages set in v_bmap, so stats need not count them
+  uint16_t asid;
+  bool readonly;       // snapshots from n_snapshot() cannot be written
+  struct slab_heap* heap;  // small objects, created on first n_malloc_small()
+};
+
+static struct extent_tree root_tree;
+static struct vm_space root_space = { .v_tree = &root_tree, .asid = 0 };
+static __thread struct vm_space* cur_space = &root_space;
+static struct vm_space* spaces[MAX_ASIDS] = { &root_space };
+
+static void v_tree_build(void);
+static void v_bmap_mark(uint32_t start, uint32_t num_pages, bool used);
+static int space_vbmap_init(struct vm_space* space);
+static void tlb_flush_asid(uint16_t asid);
+static void* alloc_frame(void);
+static int copy_data(void* va, void* val, int size, int dir, bool locked);
+static int copy_datav(const struct vm_iovec* iov, int cnt, int dir);
+
+// a slab: SLAB_SIZE bytes of virtual memory cut into objects of one size
+// class. free_bits has a bit set for every object that is neither handed
+// out nor cached by a thread. slabs with free objects are kept on their
+// class's partial list.
+struct slab {
+  vaddr_t va;
+  uint16_t cls;
+  uint16_t nfree;
+  uint64_t free_bits[SLAB_SIZE / SLAB_MIN_SIZE / 64];
+  struct slab* next;
+  struct slab** pprev;
+};
+
+// the small-object heap of an address space. dir maps a virtual page to its
+// slab, one leaf of 1 << PTX_BITS entries per superpage-sized region (indexed
+// by va >> PDXSHIFT), like a page table; leaves are created on demand and
+// never freed before the space. each class has its own lock, which guards
+// its partial list and the free_bits of its slabs.
+#define SLAB_DIR_ENTRIES ((uint32_t)(MAX_MEMSIZE >> MIN_PDX_SHIFT))
+
+struct slab_heap {
+  pthread_mutex_t locks[SLAB_CLASSES];
+  struct slab* partial[SLAB_CLASSES];
+  struct slab** dir[SLAB_DIR_ENTRIES];
+};
+
+// per-thread, per-class cache of free objects of the current space.
+// n_malloc_small()/n_free_small() pop and push without any lock; the cache
+// is handed back to the slabs when the thread switches spaces or exits.
+struct obj_mag {
+  vaddr_t objs[OBJ_MAG_SIZE];
+  uint32_t count;
+};
+
+static __thread struct obj_mag obj_mags[SLAB_CLASSES];
+static void obj_mags_flush(void);
+static void slab_heap_free(struct slab_heap* heap, bool release_pages);
+
+// p_bmap is scanned a 64-bit word at a time; frame_cursor is the next-fit
+// position (a word index) where the next refill resumes its scan
+#define P_BMAP_WORDS   (MAX_NUM_FRAMES / 64)
+
+static pthread_mutex_t frame_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t frame_cursor = 0;
+
+static void free_frame(void* pa);
+static int frames_take(uint32_t* out, uint32_t n);
+static void frames_release(const uint32_t* frames, uint32_t n);
+static int64_t frames_reserve_large(void);
+static void frames_release_run(uint32_t first, uint32_t n);
+static bool frame_retire(uint32_t frame);
+
+// per-frame pin counts for n_pin(). FRAME_PIN_FREED marks a pinned frame
+// whose mapping is already gone; the last n_unpin() then releases it.
+#define FRAME_PIN_FREED 0x8000
+#define FRAME_PIN_MAX   (FRAME_PIN_FREED - 1)
+
+static uint16_t* frame_pins;
+static void frame_unpin(uint32_t frame);
+
+// per-frame copy-on-write sharing: the number of PTEs mapping the frame
+// besides the first. n_snapshot() raises it, frame_retire() lowers it, and
+// only the mapping that finds it at 0 releases the frame.
+static uint16_t* frame_shares;
+
+// reverse map for swap: the virtual address each data frame was last mapped
+// at, with the ASID of its space in the low (offset) bits. only a hint;
+// swap_out() re-walks the page table before evicting.
+static vaddr_t* frame_owner;
+
+// per-frame count of the entries of the page table held by the frame that
+// map, reserve or swap a page, kept under the table's PDE lock. a table
+// whose count drops to 0 is unhooked by pgtbl_reclaim() and freed through
+// pgtbl_retire().
+static uint16_t* pgtbl_live;
+
+static pthread_mutex_t swap_lock = PTHREAD_MUTEX_INITIALIZER;
+static int swap_fd = -1;
+static uint64_t* swap_bmap;
+static uint32_t swap_cursor = 0;
+static uint32_t clock_hand = 0;
+
+static int64_t swap_out(void);
+static int swap_read(uint32_t slot, void* frame);
+static void swap_slot_free(uint32_t slot);
+static void bmap_fill(uint64_t* words, uint32_t start, uint32_t n, bool set);
+
+// header page of a vm_attach() image. clean is cleared while the image is
+// attached and set by vm_detach(), so an image its process did not detach
+// (a crash, or a missing vm_detach()) is never reattached half-written.
+struct image_hdr {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t clean;
+  uint32_t pgsize;
+  uint32_t pdx_bits;
+  uint32_t ptx_bits;
+  uint32_t pte_size;
+  uint64_t memsize;
+  uint64_t max_memsize;
+};
+
+#define IMAGE_VBMAP_BYTES \
+  (((size_t)V_BMAP_WORDS * sizeof(uint64_t) + PGSIZE - 1) / PGSIZE * PGSIZE)
+#define IMAGE_BYTES ((size_t)PGSIZE + MEMSIZE + IMAGE_VBMAP_BYTES)
+
+static struct image_hdr* image;    // NULL unless vm_attach() mapped one
+static bool image_restored;        // the image held a previous run's memory
+
+static void image_restore(void);
+static int fault_in(vaddr_t va);
+
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t pg_tbl_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t multi_op_lock = PTHREAD_MUTEX_INITIALIZER;
 
+// page-table walks are lock-free: PDEs and PTEs are read with atomic loads,
+// and a new page table is fully zeroed before its PDE is published with a
+// release store, so a walker never sees a half-built table. only mutation is
+// serialized, and only per page directory entry. the locks are shared by
+// index across address spaces.
+static pthread_mutex_t pde_locks[1 << MAX_PDX_BITS] = {
+  [0 ... (1 << MAX_PDX_BITS) - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+// a page table emptied by n_free() is unhooked from its PDE (see
+// pgtbl_reclaim()), but a walker that loaded the PDE earlier, or found a PTE
+// pointer in a TLB, may still be reading it. so the frame is retired rather
+// than freed: every walk runs between walk_begin() and walk_end(), which
+// announce the reclaim epoch the thread started walking in (0 while it is
+// not walking), and a table retired in epoch E goes back to the frame pool
+// only once no walker still announces an epoch <= E (see pgtbl_retire()).
+struct walker {
+  uint64_t epoch;            // announced epoch; 0 outside a walk
+  uint32_t depth;            // nesting of walk_begin() calls
+  struct walker* next;
+  struct walker** pprev;
+};
+
+struct retired_table {
+  uint32_t frame;
+  uint64_t epoch;            // reclaim epoch the table was unhooked in
+};
+
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t reclaim_epoch = 1;
+static struct walker* walkers;            // registered threads, under reclaim_lock
+static __thread struct walker walker;
+static struct retired_table* retired;     // under reclaim_lock
+static uint32_t retired_count, retired_cap;
+
+// with 48-bit addresses, the p3 tables and page directories between a
+// space's root and its page tables are added (published the same way) under
+// upper_lock, and only freed with the space
+#if VA_BITS == 48
+static pthread_mutex_t upper_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// the address range one page directory covers
+#define PGDIR_SPAN     (1ull << (PDXSHIFT + PDX_BITS))
+
+static inline pde_t* pgdir_of(pde_t* root, vaddr_t va, bool create);
+static pde_t* pgdir_next(pde_t* root, uint64_t* va);
+static void upper_frames_each(pde_t* root, void (*fn)(void* frame));
+
+// stripe locks for put_data_locked()/get_data_locked(), indexed by frame
+static pthread_mutex_t copy_locks[COPY_LOCK_STRIPES] = {
+  [0 ... COPY_LOCK_STRIPES - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
 // -----------------------------------------------------------------------------
 // Setup
 // -----------------------------------------------------------------------------
+
+/*
+ * meta_alloc()
+ * ------------
+ * Allocates zeroed metadata sized by the frame pool as an anonymous mapping
+ * without swap reservation. Its pages are committed one at a time as they
+ * are first written, so an untouched bitmap chunk costs nothing.
+ *
+ * Return: the zeroed memory; NULL on failure.
+ */
+static void* meta_alloc(size_t bytes) {
+  void* mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return (mem == MAP_FAILED) ? NULL : mem;
+}
+
+// releases memory from meta_alloc(); mem may be NULL
+static void meta_free(void* mem, size_t bytes) {
+  if(mem != NULL) munmap(mem, bytes);
+}
+
 /*
  * set_physical_mem()
  * ------------------
@@ -39,352 +360,2438 @@ void set_physical_mem(void) {
   // use 32-bit values for sizes, page counts, and offsets.
   
   // https://man7.org/linux/man-pages/man2/mmap.2.html
-  p_buff = mmap(NULL,
-               MEMSIZE,
-               PROT_READ | PROT_WRITE,
-               MAP_PRIVATE | MAP_ANONYMOUS, 
-               -1,
-               0);
+  if(image != NULL) {
+    // vm_attach() already mapped the pool, right behind the image header
+    p_buff = (char*)image + PGSIZE;
+  } else {
+    p_buff = mmap(NULL,
+                 MEMSIZE,
+                 PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, 
+                 -1,
+                 0);
+  }
 
   if(p_buff == MAP_FAILED) {
     perror("mmap failed.");
     exit(1);
   }
 
-  memset(&tlb_store, 0, sizeof(tlb_store));
+  // only the first TLB_SETS sets of tlb_store are in use
+  memset(tlb_store.sets, 0, TLB_SETS * sizeof(tlb_store.sets[0]));
 
-  uint32_t p_bmap_bytes = ((MEMSIZE / PGSIZE) + 7) / 8;
-  p_bmap = malloc(p_bmap_bytes);
-  memset(p_bmap, 0, p_bmap_bytes);
+  // nothing below is written ahead of use: a bitmap or counter page is
+  // committed by the first frame that needs it
+  uint32_t p_bmap_bytes = ((MEMSIZE >> OFFSET_BITS) + 7) / 8;
+  p_bmap = meta_alloc(p_bmap_bytes);
 
-  uint32_t v_bmap_bytes = ((MAX_MEMSIZE / PGSIZE) + 7) / 8;
-  v_bmap = malloc(v_bmap_bytes);
-  memset(v_bmap, 0, v_bmap_bytes);
-  
-  pthread_mutex_lock(&lock);
-  set_bit(v_bmap, 0);
-  pthread_mutex_unlock(&lock);
-  
-  // the top frame(s) are reserved for the page directory (pgdir)
-  uint32_t max_pd_entries = 1 << PDX_BITS;
-  uint32_t max_pd_bytes = max_pd_entries * sizeof(pde_t);
-  uint32_t max_pd_pages = (max_pd_bytes + PGSIZE - 1) / PGSIZE;
+  frame_pins = meta_alloc(MAX_NUM_FRAMES * sizeof(uint16_t));
+  frame_owner = meta_alloc(MAX_NUM_FRAMES * sizeof(vaddr_t));
+  frame_shares = meta_alloc(MAX_NUM_FRAMES * sizeof(uint16_t));
+  pgtbl_live = meta_alloc(MAX_NUM_FRAMES * sizeof(uint16_t));
 
+  if(p_bmap == NULL || frame_pins == NULL || frame_owner == NULL ||
+     frame_shares == NULL || pgtbl_live == NULL) {
+    perror("metadata mmap failed.");
+    exit(1);
+  }
 
-  pgdir = (pde_t*)p_buff;
-  memset(pgdir, 0, max_pd_bytes);
+  // the top frame(s) are reserved for the root table (pgdir): the page
+  // directory, or the p4 table with 48-bit addresses
+  uint32_t max_pd_entries = 1 << ROOT_BITS;
+  uint32_t max_pd_bytes = max_pd_entries * sizeof(pde_t);
+  uint32_t max_pd_pages = (max_pd_bytes + PGSIZE - 1) >> OFFSET_BITS;
 
-  //mark these frames as occupied in the virtual/physical bitmaps
-  uint32_t max_frames_in_bytes = max_pd_pages / 8;
-  memset(p_bmap, 0xFF, max_frames_in_bytes);
+  root_space.pgdir = (pde_t*)p_buff;
+  if(image != NULL) {
+    root_space.v_bmap = (uint64_t*)((char*)p_buff + MEMSIZE);
+  }
 
-  uint32_t remainder_frames = max_pd_pages % 8;
-  for(int i = 0; i < remainder_frames; i++) {
-    set_bit(p_bmap, (max_frames_in_bytes * 8) + i);
+  if(image_restored) {
+    image_restore();
+  } else {
+    space_vbmap_init(&root_space);
+    memset(root_space.pgdir, 0, max_pd_bytes);
   }
-}
 
-// -----------------------------------------------------------------------------
-// TLB
-// -----------------------------------------------------------------------------
+  //mark these frames as occupied in the physical bitmap
+  pthread_mutex_lock(&frame_lock);
+  bmap_fill(p_bmap, 0, max_pd_pages, true);
+  frame_cursor = max_pd_pages / 64;
+  pthread_mutex_unlock(&frame_lock);
+}
 
 /*
- * TLB_add()
- * ---------
- * Adds a new virtual-to-physical translation to the TLB.
- * Ensure thread safety when updating shared TLB data.
- *
- * Return:
- *   0  -> Success (translation successfully added)
- *  -1  -> Failure (e.g., TLB full or invalid input)
+ * prefault_main()
+ * ---------------
+ * Background thread of vm_init(): populates the frame pool PREFAULT_CHUNK
+ * bytes at a time, lowest frames first, since next-fit hands those out
+ * first. MADV_POPULATE_WRITE faults pages in without writing to them, so it
+ * is safe next to threads already using the pool; without it (older
+ * kernels and headers) pages keep faulting in on first touch.
  */
-int TLB_add(void *va, void *pa)
+static void* prefault_main(void* arg)
 {
-    vaddr32_t va_u = VA2U(va);
-    uint32_t vpn = va_u >> OFFSET_BITS;
-    pte_t* pte_ptr = (pte_t*)pa;
-
-    pthread_mutex_lock(&lock);
-    // upsert the entry
-    for(int i = 0; i < TLB_ENTRIES; i++) {
-      if(tlb_store.in_use[i] && vpn == tlb_store.vpn[i]) {
-        tlb_store.pte[i] = pte_ptr;
-        tlb_store.last_used[i] = tlb_lookups;
-        pthread_mutex_unlock(&lock);
-        return 0;
-      } 
-    }
-   
-    for(int i = 0; i < TLB_ENTRIES; i++) {
-      if(!tlb_store.in_use[i]) {
-        tlb_store.vpn[i] = vpn;
-        tlb_store.pte[i] = pte_ptr;
-        tlb_store.in_use[i] = true;
-        tlb_store.last_used[i] = tlb_lookups;
-        pthread_mutex_unlock(&lock);
-        return 0;
-      }
-    }
- 
-    pthread_mutex_unlock(&lock);
-    return -1;
+  (void)arg;
+#ifdef MADV_POPULATE_WRITE
+  for(size_t off = 0; off < MEMSIZE; off += PREFAULT_CHUNK) {
+    if(madvise((char*)p_buff + off, PREFAULT_CHUNK, MADV_POPULATE_WRITE) != 0) break;
+  }
+#endif
+  return NULL;
 }
 
 /*
- * TLB_check()
- * -----------
- * Looks up a virtual address in the TLB.
- 
- * Return:
- *   Pointer to the corresponding page table entry (PTE) if found.
- *   NULL if the translation is not found (TLB miss).
+ * layout_config()
+ * ---------------
+ * Derives the memory layout a config asks for, with every zero field left
+ * at its default.
+ *
+ * Return: 0 on success, -1 if the config is out of bounds.
  */
-pte_t *TLB_check(void *va)
+static int layout_config(const struct vm_config* config, struct vm_layout* out)
 {
-    vaddr32_t va_u = VA2U(va);
-    uint32_t target_vpn = va_u >> OFFSET_BITS;
+  uint32_t pgsize = config->pgsize ? config->pgsize : DEFAULT_PGSIZE;
+  uint64_t memsize = config->memsize ? config->memsize : DEFAULT_MEMSIZE;
+  uint32_t tlb_entries = config->tlb_entries ? config->tlb_entries : DEFAULT_TLB_ENTRIES;
 
-    pthread_mutex_lock(&lock);
-    tlb_lookups++;
+  if(pgsize < MIN_PGSIZE || pgsize > MAX_PGSIZE || (pgsize & (pgsize - 1))) return -1;
+  if(tlb_entries < MIN_TLB_ENTRIES || tlb_entries > MAX_TLB_ENTRIES ||
+     (tlb_entries & (tlb_entries - 1))) return -1;
 
-    // linear scan through TLB
-    for(int i = 0; i < TLB_ENTRIES; i++) {
-      if(tlb_store.in_use[i] && target_vpn == tlb_store.vpn[i]) {
-        tlb_store.last_used[i] = tlb_lookups;
+  uint32_t offset_bits = __builtin_ctz(pgsize);
+#if VA_BITS == 32
+  uint32_t vpn_bits = 32 - offset_bits;
+  uint32_t pdx_bits = config->pdx_bits ? config->pdx_bits : vpn_bits / 2;
+  if(pdx_bits > MAX_PDX_BITS || pdx_bits >= vpn_bits) return -1;
+  uint32_t ptx_bits = vpn_bits - pdx_bits;
+  if(ptx_bits < MIN_PTX_BITS || ptx_bits > MAX_PTX_BITS) return -1;
+#else
+  // every table fills one frame of 64-bit entries; the page directory may
+  // be narrower, as long as the two upper levels still cover the rest
+  uint32_t level_bits = offset_bits - 3;
+  uint32_t ptx_bits = level_bits;
+  uint32_t pdx_bits = config->pdx_bits ? config->pdx_bits : level_bits;
+  if(pdx_bits > level_bits) return -1;
+  uint32_t upper_bits = VA_BITS - offset_bits - ptx_bits - pdx_bits;
+  uint32_t p4_bits = upper_bits / 2;
+  uint32_t p3_bits = upper_bits - p4_bits;
+  if(p3_bits > level_bits) return -1;
+#endif
 
-        pthread_mutex_unlock(&lock);
-        return tlb_store.pte[i];
-      }
-    }
-    
-    tlb_misses++;
-    pthread_mutex_unlock(&lock);
-    return NULL; 
+  uint64_t superpage = (uint64_t)pgsize << ptx_bits;
+  if(memsize > MAX_PHYS_MEMSIZE || memsize % superpage != 0) return -1;
+
+  out->pgsize = pgsize;
+  out->offset_bits = offset_bits;
+  out->pdx_bits = pdx_bits;
+  out->ptx_bits = ptx_bits;
+  out->pdx_shift = offset_bits + ptx_bits;
+  out->off_mask = pgsize - 1;
+  out->ptx_mask = (1u << ptx_bits) - 1;
+  out->num_frames = (uint32_t)(memsize / pgsize);
+  out->memsize = memsize;
+  out->tlb_entries = tlb_entries;
+  out->tlb_sets = tlb_entries / TLB_WAYS;
+  out->tlb_set_bits = __builtin_ctz(out->tlb_sets);
+  out->pdx_mask = (1u << pdx_bits) - 1;
+#if VA_BITS == 48
+  out->p3_shift = out->pdx_shift + pdx_bits;
+  out->p3_mask = (1u << p3_bits) - 1;
+  out->p4_shift = VA_BITS - p4_bits;
+  out->p4_bits = p4_bits;
+#endif
+  return 0;
 }
 
 /*
- * print_TLB_missrate()
- * --------------------
- * Calculates and prints the TLB miss rate.
+ * vm_init()
+ * ---------
+ * Initializes physical memory now rather than inside the first n_malloc(),
+ * so that the caller chooses when the setup cost is paid, and fixes the
+ * memory layout (page size, memory size, PDX/PTX split, TLB size) from
+ * config. With config->prefault, the frame pool is also faulted in from a
+ * detached background thread, keeping first-touch page faults off the
+ * allocation path. config may be NULL for the defaults.
  *
- * Return value: None.
+ * Return:
+ *   0  -> Success
+ *  -1  -> Failure (memory is already initialized, or config is invalid)
  */
-void print_TLB_missrate(void)
+int vm_init(const struct vm_config *config)
 {
-    double miss_rate;
-    if(tlb_lookups > 0) {
-      miss_rate = (double)tlb_misses / tlb_lookups;
-    } else {
-      miss_rate = 0.0;
-    }
-    
-    fprintf(stderr, "TLB miss rate %lf \n", miss_rate);
-    fprintf(stderr, "TLB Lookups: %llu\n", tlb_lookups);
-    fprintf(stderr, "TLB Misses:  %llu\n", tlb_misses);
-    fprintf(stderr, "TLB Hits:    %llu\n", tlb_lookups - tlb_misses);
-    fprintf(stderr, "TLB miss rate: %lf (%.4f%%)\n", miss_rate, miss_rate * 100);
-    fprintf(stderr, "TLB hit rate:  %.4f%%\n", (1.0 - miss_rate) * 100);
+  struct vm_config defaults = { 0 };
+  struct vm_layout layout;
+  if(config == NULL) config = &defaults;
+  if(layout_config(config, &layout) == -1) return -1;
+
+  pthread_mutex_lock(&multi_op_lock);
+  if(root_space.pgdir != NULL) {
+    pthread_mutex_unlock(&multi_op_lock);
+    return -1;
+  }
+  vm_layout = layout;
+  set_physical_mem();
+  pthread_mutex_unlock(&multi_op_lock);
+
+  pthread_t prefaulter;
+  if(config->prefault &&
+     pthread_create(&prefaulter, NULL, prefault_main, NULL) == 0) {
+    pthread_detach(prefaulter);
+  }
+  return 0;
 }
 
 // -----------------------------------------------------------------------------
-// Page Table
+// Persistent Image
 // -----------------------------------------------------------------------------
 
 /*
- * translate()
+ * image_layout_ok()
+ * -----------------
+ * Checks that an image header was written with the memory layout in effect.
+ */
+static bool image_layout_ok(const struct image_hdr* hdr)
+{
+  return hdr->magic == IMAGE_MAGIC && hdr->version == IMAGE_VERSION &&
+         hdr->pgsize == PGSIZE && hdr->pdx_bits == PDX_BITS &&
+         hdr->ptx_bits == PTX_BITS && hdr->pte_size == sizeof(pte_t) &&
+         hdr->memsize == MEMSIZE && hdr->max_memsize == MAX_MEMSIZE;
+}
+
+/*
+ * vm_attach()
  * -----------
- * Translates a virtual address to a physical address.
- * Perform a TLB lookup first; if not found, walk the page directory
- * and page tables using a two-level lookup.
+ * Maps the image file at path shared, so that the frame pool and the root
+ * space's v_bmap live in it, and initializes physical memory on top of it,
+ * with the memory layout of config (as vm_init() takes it; NULL for the
+ * defaults). A new (empty) file is sized to IMAGE_BYTES, which stays sparse
+ * until pages are touched; config->prefault is ignored, since populating
+ * the pool would allocate the whole file. An existing one is only accepted
+ * if it was written with the same layout and vm_detach() marked it clean;
+ * its pages then come back as they were, without copying any of them.
  *
  * Return:
- *   Pointer to the PTE structure if translation succeeds.
- *   NULL if translation fails (e.g., page not mapped).
+ *   1  -> Success (a previous image was restored)
+ *   0  -> Success (a new image was created)
+ *  -1  -> Failure (memory already in use, invalid config, bad, unclean or
+ *         differently laid out image, I/O error)
  */
-pte_t* translate(pde_t* pgdir, void* va)
+int vm_attach(const char *path, const struct vm_config *config)
 {
-    // extract the 32-bit virtual address and compute indices
-    // for the page directory, page table, and offset.
-    // return the corresponding PTE (i.e. p_frame) if found
- 
-    vaddr32_t v_addr = VA2U(va);
-    uint32_t pgdir_idx = PDX(v_addr);
+  struct vm_config defaults = { 0 };
+  struct vm_layout layout;
+  if(path == NULL) return -1;
+  if(config == NULL) config = &defaults;
+  if(layout_config(config, &layout) == -1) return -1;
 
-    pte_t* cache_hit = TLB_check(va);
-    if(cache_hit != NULL) {
-      return cache_hit;
+  pthread_mutex_lock(&multi_op_lock);
+  if(root_space.pgdir != NULL || image != NULL) {
+    pthread_mutex_unlock(&multi_op_lock);
+    return -1;
+  }
+
+  // IMAGE_BYTES and the header check below follow the requested layout
+  struct vm_layout prev_layout = vm_layout;
+  vm_layout = layout;
+
+  struct stat st;
+  void* base = MAP_FAILED;
+  int fd = open(path, O_RDWR | O_CREAT, 0600);
+  bool fresh = false;
+  if(fd >= 0 && fstat(fd, &st) == 0) {
+    fresh = (st.st_size == 0);
+    bool sized = fresh ? ftruncate(fd, IMAGE_BYTES) == 0
+                       : st.st_size == (off_t)IMAGE_BYTES;
+    if(sized) {
+      base = mmap(NULL, IMAGE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     }
+  }
+  if(fd >= 0) close(fd);   // the mapping keeps the file open
 
-    // tlb miss: procedure
-    pthread_mutex_lock(&pg_tbl_lock);
-    pde_t pgdir_entry = pgdir[pgdir_idx];
+  struct image_hdr* hdr = base;
+  if(base != MAP_FAILED && !fresh && !(image_layout_ok(hdr) && hdr->clean)) {
+    munmap(base, IMAGE_BYTES);
+    base = MAP_FAILED;
+  }
+  if(base == MAP_FAILED) {
+    vm_layout = prev_layout;
+    pthread_mutex_unlock(&multi_op_lock);
+    return -1;
+  }
 
-    if(pgdir_entry == 0) {
-      pthread_mutex_unlock(&pg_tbl_lock);
-      return NULL;
-    } 
+  if(fresh) {
+    hdr->magic = IMAGE_MAGIC;
+    hdr->version = IMAGE_VERSION;
+    hdr->pgsize = PGSIZE;
+    hdr->pdx_bits = PDX_BITS;
+    hdr->ptx_bits = PTX_BITS;
+    hdr->pte_size = sizeof(pte_t);
+    hdr->memsize = MEMSIZE;
+    hdr->max_memsize = MAX_MEMSIZE;
+  }
 
-    uint32_t pgtbl_offset = pgdir_entry & ~OFFMASK;
-    pte_t* pgtbl = (pte_t*)((char*)p_buff + pgtbl_offset); 
+  // unclean on disk until vm_detach(), whatever happens meanwhile
+  hdr->clean = 0;
+  msync(hdr, PGSIZE, MS_SYNC);
 
-    uint32_t pgtbl_idx = PTX(v_addr);
-    pte_t* pgtbl_entry_ptr = &(pgtbl[pgtbl_idx]);
+  image = hdr;
+  image_restored = !fresh;
+  set_physical_mem();
+  pthread_mutex_unlock(&multi_op_lock);
+  return image_restored ? 1 : 0;
+}
 
-    if(pgtbl_entry_ptr == NULL) {
-      pthread_mutex_unlock(&pg_tbl_lock);
-      return NULL;
-    }
+// marks the frame of a table found in a restored image as in use
+static void frame_claim(void* pa)
+{
+  bmap_fill(p_bmap, ((char*)pa - (char*)p_buff) >> OFFSET_BITS, 1, true);
+}
+
+/*
+ * image_restore()
+ * ---------------
+ * Rebuilds the state that lives outside the image from the root space's
+ * page tables (and the upper tables above them): p_bmap, the live-entry count of every table and the swap
+ * hints of data frames, plus the extent tree over the restored v_bmap.
+ * Frames that sat in thread magazines or only belonged to other spaces when
+ * the image was detached come back free. No snapshot survives its process,
+ * so PTE_COW is dropped from every entry. Called by set_physical_mem().
+ */
+static void image_restore(void)
+{
+  uint64_t* words = p_bmap;
+  pde_t* pgdir;
 
-    paddr32_t pa = (*pgtbl_entry_ptr & ~OFFMASK);
-    void* pa_ptr = (char*)p_buff + pa; 
-    pthread_mutex_unlock(&pg_tbl_lock);
+  upper_frames_each(root_space.pgdir, frame_claim);
+  for(uint64_t base = 0; (pgdir = pgdir_next(root_space.pgdir, &base)) != NULL;
+      base += PGDIR_SPAN) {
+    for(uint32_t pgdir_idx = 0; pgdir_idx < (1u << PDX_BITS); pgdir_idx++) {
+      pde_t pgdir_entry = pgdir[pgdir_idx];
+      uint32_t first = (pgdir_entry & ~OFFMASK) >> OFFSET_BITS;
 
-    TLB_add(va, pgtbl_entry_ptr);
+      if(pgdir_entry & PDE_LARGE) {
+        bmap_fill(words, first, PGS_PER_SUPERPAGE, true);
+        continue;
+      }
+      if(!(pgdir_entry & IN_USE)) continue;
 
-    return pgtbl_entry_ptr;
+      bmap_fill(words, first, 1, true);
+      pte_t* pgtbl = (pte_t*)((char*)p_buff + (pgdir_entry & ~OFFMASK));
+      vaddr_t span = base + ((vaddr_t)pgdir_idx << PDXSHIFT);
+      uint16_t live = 0;
+      for(uint32_t i = 0; i < (1u << PTX_BITS); i++) {
+        pte_t entry = pgtbl[i] & ~PTE_COW;
+        pgtbl[i] = entry;
+        if(entry != 0) live++;
+        if(entry & IN_USE) {
+          uint32_t frame = (entry & ~OFFMASK) >> OFFSET_BITS;
+          bmap_fill(words, frame, 1, true);
+          frame_owner[frame] = span + i * PGSIZE;
+        }
+      }
+      pgtbl_live[first] = live;
+    }
+  }
+
+  pthread_mutex_lock(&lock);
+  v_tree_build();
+  pthread_mutex_unlock(&lock);
 }
 
 /*
- * map_page()
+ * vm_detach()
  * -----------
- * Establishes a mapping between a virtual and a physical page.
- * Creates intermediate page tables if necessary.
+ * Makes the attached image self-contained and durable: the slabs of small
+ * objects are freed, pages of the root space in swap are read back (the
+ * swap file dies with the process), then the whole image is flushed and
+ * its header marked clean. Fails, and
+ * leaves the image unclean, if the pool cannot hold every page at once.
  *
  * Return:
- *   0  -> Success (mapping created)
- *  -1  -> Failure (e.g., no space or invalid address)
+ *   0  -> Success (the image can be reattached)
+ *  -1  -> Failure (no image attached, pages left in swap, or I/O error)
  */
-int map_page(pde_t *pgdir, void *va, void *pa)
+int vm_detach(void)
 {
-    // TODO: map virtual address to physical address in the page tables.
-    // make this threadsafe
-    // check if there is an existing mapping for a virtual address
-    vaddr32_t v_addr = VA2U(va);
-    uint32_t pgdir_idx = PDX(v_addr);
-    uint32_t pgtbl_idx = PTX(v_addr);
- 
-    pthread_mutex_lock(&pg_tbl_lock);
-    // "upsert" the target page table
-    if(!(pgdir[pgdir_idx] & IN_USE)) {
-      // allocate pgtbl and zero it
+  pthread_mutex_lock(&multi_op_lock);
+  if(image == NULL || image->clean) {
+    pthread_mutex_unlock(&multi_op_lock);
+    return -1;
+  }
 
-      void* pgtbl_frame = alloc_frame();
-      if(pgtbl_frame == NULL) {
-        pthread_mutex_unlock(&pg_tbl_lock);
-        return -1;
-      }
-      
-      memset(pgtbl_frame, 0, PGSIZE);
-      uint32_t pgdir_offset = (char*)pgtbl_frame - (char*)p_buff;
-      pgdir[pgdir_idx] = pgdir_offset | IN_USE;
-    }
+  // fault_in() works on the current space
+  struct vm_space* prev = cur_space;
+  cur_space = &root_space;
+  pde_t* pgdir;
 
-    uint32_t pgtbl_offset = pgdir[pgdir_idx] & ~OFFMASK;
-    pte_t* pgtbl = (pte_t*)((char*)p_buff + pgtbl_offset);
+  // slab headers live in host memory and are not saved, so a reattached
+  // image could never reach the objects; hand their pages back instead of
+  // leaving them allocated in v_bmap
+  if(root_space.heap != NULL) {
+    obj_mags_flush();
+    slab_heap_free(root_space.heap, true);
+    root_space.heap = NULL;
+  }
 
-    if(!(pgtbl[pgtbl_idx] & IN_USE)) {
-      uint32_t pa_offset = (char*)pa - (char*)p_buff;
-      pgtbl[pgtbl_idx] = pa_offset | IN_USE;
+  // reading a page back may evict another, so check again afterwards
+  uint32_t swapped = 0;
+  for(int pass = 0; pass < 2; pass++) {
+    swapped = 0;
+    for(uint64_t base = 0; (pgdir = pgdir_next(root_space.pgdir, &base)) != NULL;
+        base += PGDIR_SPAN) {
+      for(uint32_t pgdir_idx = 0; pgdir_idx < (1u << PDX_BITS); pgdir_idx++) {
+        pde_t pgdir_entry = __atomic_load_n(&pgdir[pgdir_idx], __ATOMIC_ACQUIRE);
+        if(!(pgdir_entry & IN_USE) || (pgdir_entry & PDE_LARGE)) continue;
 
-      pthread_mutex_unlock(&pg_tbl_lock);
-      return 0;
+        pte_t* pgtbl = (pte_t*)((char*)p_buff + (pgdir_entry & ~OFFMASK));
+        vaddr_t span = base + ((vaddr_t)pgdir_idx << PDXSHIFT);
+        for(uint32_t i = 0; i < (1u << PTX_BITS); i++) {
+          if(!(pgtbl[i] & PTE_SWAPPED)) continue;
+          if(pass == 0) fault_in(span + i * PGSIZE);
+          else swapped++;
+        }
+      }
     }
+  }
+  cur_space = prev;
 
-    pthread_mutex_unlock(&pg_tbl_lock);
-    return -1;
-
+  int ret = -1;
+  if(swapped == 0 && msync(image, IMAGE_BYTES, MS_SYNC) == 0) {
+    image->clean = 1;
+    ret = msync(image, PGSIZE, MS_SYNC);
+  }
+  pthread_mutex_unlock(&multi_op_lock);
+  return ret;
 }
 
 // -----------------------------------------------------------------------------
-// Allocation
+// Address Spaces
 // -----------------------------------------------------------------------------
 
 /*
- * get_next_avail()
- * ----------------
- * Finds and returns the base virtual address of the next available
- * block of contiguous free pages.
+ * space_vbmap_init()
+ * ------------------
+ * Gives a space an empty v_bmap and extent tree. Virtual page 0 stays
+ * reserved so that no allocation maps to NULL.
  *
- * Return:
- *   Pointer to the base virtual address if available.
- *   NULL if there are no sufficient free pages.
+ * Return: 0 on success, -1 if out of memory.
  */
-void *get_next_avail(int num_pages)
+static int space_vbmap_init(struct vm_space* space)
 {
-    if(num_pages <= 0) return NULL;
+  // the root space's v_bmap may already be given (zeroed) by an image
+  if(space->v_bmap == NULL) space->v_bmap = meta_alloc(V_BMAP_WORDS * sizeof(uint64_t));
+  if(space->v_bmap == NULL) return -1;
 
-    uint32_t chunk_start; 
-    uint32_t ctr = 0;
-    pthread_mutex_lock(&lock);
-    for(int i = 0; i < (MAX_MEMSIZE / PGSIZE) ; i++) {
-      if(get_bit(v_bmap, i) == 0) {
-        if(ctr == 0) {
-          chunk_start = i;
-        }
+  // the extent tree helpers work on the current space. the space's tree is
+  // zeroed, which already describes an empty v_bmap.
+  struct vm_space* prev = cur_space;
+  cur_space = space;
+  pthread_mutex_lock(&lock);
+  v_bmap_mark(0, 1, true);
+  pthread_mutex_unlock(&lock);
+  cur_space = prev;
+  return 0;
+}
 
-        ctr++;
-        if(ctr == num_pages) {
-          // return void* to the corresponding vpage addr
-          uint32_t vpage_byte_offset = chunk_start * PGSIZE;
-          pthread_mutex_unlock(&lock);
-          return U2VA(vpage_byte_offset);
-        }
-      } else ctr = 0; 
-    }
+/*
+ * vm_space_create()
+ * -----------------
+ * Creates an empty address space with its own page directory and ASID.
+ * Frames, swap and the TLB are shared with every other space.
+ *
+ * Return: the new space; NULL if out of ASIDs or memory.
+ */
+struct vm_space* vm_space_create(void)
+{
+  pthread_mutex_lock(&multi_op_lock);
+  if(root_space.pgdir == NULL) set_physical_mem();
+  pthread_mutex_unlock(&multi_op_lock);
 
-    pthread_mutex_unlock(&lock);
-    return NULL; // No available block placeholder.
+  struct vm_space* space = calloc(1, sizeof(struct vm_space));
+  if(space == NULL) return NULL;
+  space->v_tree = meta_alloc(sizeof(struct extent_tree));
+  space->pgdir = alloc_frame();
+  if(space->v_tree == NULL || space->pgdir == NULL || space_vbmap_init(space) == -1) {
+    if(space->pgdir != NULL) free_frame(space->pgdir);
+    meta_free(space->v_bmap, V_BMAP_WORDS * sizeof(uint64_t));
+    meta_free(space->v_tree, sizeof(struct extent_tree));
+    free(space);
+    return NULL;
+  }
+  memset(space->pgdir, 0, PGSIZE);
+
+  pthread_mutex_lock(&swap_lock);
+  uint32_t asid = 1;
+  while(asid < MAX_ASIDS && spaces[asid] != NULL) asid++;
+  if(asid < MAX_ASIDS) {
+    space->asid = asid;
+    spaces[asid] = space;
+  }
+  pthread_mutex_unlock(&swap_lock);
+
+  if(asid == MAX_ASIDS) {
+    free_frame(space->pgdir);
+    meta_free(space->v_bmap, V_BMAP_WORDS * sizeof(uint64_t));
+    meta_free(space->v_tree, sizeof(struct extent_tree));
+    free(space);
+    return NULL;
+  }
+  return space;
 }
 
 /*
- * n_malloc()
- * -----------
- * Allocates a given number of bytes in virtual memory.
- * Initializes physical memory and page directories if not already done.
+ * vm_space_switch()
+ * -----------------
+ * Makes space the calling thread's current address space; NULL selects the
+ * root space. TLB entries are tagged with their ASID, so nothing is flushed
+ * and the translations of the other spaces stay cached. Small objects the
+ * thread caches go back to the slabs of the space it leaves.
  *
- * Return:
- *   Pointer to the starting virtual address of allocated memory (success).
- *   NULL if allocation fails.
+ * Return: the previously current space.
  */
+struct vm_space* vm_space_switch(struct vm_space* space)
+{
+  struct vm_space* prev = cur_space;
+  struct vm_space* next = (space != NULL) ? space : &root_space;
 
-void *n_malloc(unsigned int num_bytes)
+  // cached small objects belong to the space they came from
+  if(next != prev) obj_mags_flush();
+  cur_space = next;
+  return prev;
+}
+
+/*
+ * vm_space_destroy()
+ * ------------------
+ * Releases every frame and swap slot still mapped in a space, then its page
+ * tables, page directories (and upper tables) and ASID. Pinned frames are released by their last
+ * n_unpin(). The caller guarantees that no thread still uses the space.
+ *
+ * Return: 0 on success; -1 for the root space or the caller's current one.
+ */
+int vm_space_destroy(struct vm_space* space)
 {
-    if(num_bytes == 0) return NULL;
-    
-    pthread_mutex_lock(&multi_op_lock);
-    if(pgdir == NULL) set_physical_mem();
+  if(space == NULL || space == &root_space || space == cur_space) return -1;
 
-    uint32_t num_pages = (num_bytes + PGSIZE - 1) / PGSIZE;
-    void* va_base_raw = get_next_avail(num_pages);
+  // no entry tagged with the ASID may outlive it, or its next owner would
+  // hit this space's page tables
+  tlb_flush_asid(space->asid);
 
-    if(va_base_raw == NULL) {
-      pthread_mutex_unlock(&multi_op_lock);
-      return NULL;
-    }
-    vaddr32_t va_base = VA2U(va_base_raw);
+  // from here on swap_out() leaves the space alone
+  pthread_mutex_lock(&swap_lock);
+  spaces[space->asid] = NULL;
+  pthread_mutex_unlock(&swap_lock);
 
-    for(uint32_t i = 0; i < num_pages; i++) {
-      void* pa = alloc_frame();
-      if(pa == NULL) {
-        pthread_mutex_unlock(&multi_op_lock);
-        return NULL;
-      }
+  uint32_t frames[MAX_PGS_PER_SUPERPAGE];
+  pde_t* pgdir;
+  for(uint64_t base = 0; (pgdir = pgdir_next(space->pgdir, &base)) != NULL;
+      base += PGDIR_SPAN) {
+    for(uint32_t pgdir_idx = 0; pgdir_idx < (1u << PDX_BITS); pgdir_idx++) {
+      pde_t pgdir_entry = pgdir[pgdir_idx];
+      uint32_t n = 0;
 
-      void* va = U2VA(va_base + (i * PGSIZE));
-      int ret = map_page(pgdir, va, pa);
-      if(ret == -1) {
-        pthread_mutex_unlock(&multi_op_lock);
-        return NULL;
+      if(pgdir_entry & PDE_LARGE) {
+        uint32_t first = (pgdir_entry & ~OFFMASK) >> OFFSET_BITS;
+        for(uint32_t i = 0; i < PGS_PER_SUPERPAGE; i++) {
+          if(frame_retire(first + i)) frames[n++] = first + i;
+        }
+      } else if(pgdir_entry & IN_USE) {
+        pte_t* pgtbl = (pte_t*)((char*)p_buff + (pgdir_entry & ~OFFMASK));
+        for(uint32_t i = 0; i < (1u << PTX_BITS); i++) {
+          pte_t entry = pgtbl[i];
+          uint32_t frame = (entry & ~OFFMASK) >> OFFSET_BITS;
+          if((entry & IN_USE) && frame_retire(frame)) frames[n++] = frame;
+          else if(entry & PTE_SWAPPED) swap_slot_free((entry & ~OFFMASK) >> OFFSET_BITS);
+        }
+        free_frame(pgtbl);
       }
+      frames_release(frames, n);
+    }
+  }
 
-      uint32_t v_page_bit_idx = (va_base / PGSIZE) + i;
+  upper_frames_each(space->pgdir, free_frame);
+  free_frame(space->pgdir);
+  slab_heap_free(space->heap, false);
+  meta_free(space->v_bmap, V_BMAP_WORDS * sizeof(uint64_t));
+  meta_free(space->v_tree, sizeof(struct extent_tree));
+  free(space);
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+// TLB
+// -----------------------------------------------------------------------------
+
+/*
+ * tlb_set_idx()
+ * -------------
+ * Hashes a virtual page number to its TLB set (fibonacci hashing), so that
+ * both sequential and power-of-two strided page walks spread across sets.
+ * The ASID is mixed in above the vpn bits, so that spaces using the same
+ * addresses do not all compete for the same sets.
+ */
+static inline uint32_t tlb_set_idx(vaddr_t vpn, uint16_t asid)
+{
+#if VA_BITS == 32
+    return ((vpn ^ ((uint32_t)asid << 20)) * 0x9E3779B1u) >> (32 - TLB_SET_BITS);
+#else
+    return ((vpn ^ ((uint64_t)asid << 40)) * 0x9E3779B97F4A7C15ull) >> (64 - TLB_SET_BITS);
+#endif
+}
+
+/*
+ * tlb_tag()
+ * ---------
+ * TLB key for a translation: the vpn for a page, or TLB_LARGE_TAG | its
+ * superpage number when the entry is a superpage PDE, so one tag covers all
+ * of its pages.
+ */
+static inline vaddr_t tlb_tag(vaddr_t va, pte_t* entry)
+{
+    if(__atomic_load_n(entry, __ATOMIC_RELAXED) & PDE_LARGE) {
+      return TLB_LARGE_TAG | (va >> PDXSHIFT);
+    }
+    return va >> OFFSET_BITS;
+}
+
+/*
+ * entry_live()
+ * ------------
+ * Cached entries can go stale: n_free() clears PTEs, and superpages are
+ * freed or split into page tables. An entry is only usable if it is present
+ * and still maps memory.
+ */
+static inline bool entry_live(pte_t* entry, pte_t e)
+{
+    // only a PDE that names a page table carries PDE_TABLE, and a cached
+    // pointer to one is never a translation: the superpage it was cached as
+    // has been split
+    (void)entry;
+    return (e & (IN_USE | PDE_TABLE)) == IN_USE;
+}
+
+static inline bool tlb_entry_live(pte_t* entry)
+{
+    return entry_live(entry, __atomic_load_n(entry, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * pte_touch()
+ * -----------
+ * Sets PTE_REFERENCED for the CLOCK hand. The bit is only written while it
+ * is clear, so a hot page costs a read, and by CAS, so an entry cleared or
+ * swapped out meanwhile is left alone.
+ */
+static inline void pte_touch(pte_t* entry)
+{
+    pte_t e = __atomic_load_n(entry, __ATOMIC_RELAXED);
+    if((e & (IN_USE | PTE_REFERENCED)) == IN_USE) {
+      __atomic_compare_exchange_n(entry, &e, e | PTE_REFERENCED, false,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * vm_thread_exit()
+ * ----------------
+ * Thread-exit destructor: returns the exiting thread's cached objects to
+ * their slabs and its cached frames to p_bmap, and folds its statistics
+ * shard into the retired totals.
+ */
+static void vm_thread_exit(void* arg)
+{
+    (void)arg;
+
+    // cached objects first: releasing a slab can hand frames to frame_mag
+    obj_mags_flush();
+    frames_release(frame_mag.frames, frame_mag.count);
+    frame_mag.count = 0;
+
+    pthread_mutex_lock(&stats_lock);
+    stat_retired.l1_hits += stat_shard.l1_hits;
+    stat_retired.tlb_hits += stat_shard.tlb_hits;
+    stat_retired.tlb_misses += stat_shard.tlb_misses;
+    stat_retired.tlb_evictions += stat_shard.tlb_evictions;
+    stat_retired.tlb_prefetches += stat_shard.tlb_prefetches;
+    stat_retired.tlb_prefetch_hits += stat_shard.tlb_prefetch_hits;
+    stat_retired.pgtbl_walks += stat_shard.pgtbl_walks;
+    stat_retired.bytes_read += stat_shard.bytes_read;
+    stat_retired.bytes_written += stat_shard.bytes_written;
+
+    *stat_shard.pprev = stat_shard.next;
+    if(stat_shard.next != NULL) stat_shard.next->pprev = stat_shard.pprev;
+    pthread_mutex_unlock(&stats_lock);
+
+    pthread_mutex_lock(&reclaim_lock);
+    *walker.pprev = walker.next;
+    if(walker.next != NULL) walker.next->pprev = walker.pprev;
+    pthread_mutex_unlock(&reclaim_lock);
+}
+
+static void vm_thread_key_init(void)
+{
+    pthread_key_create(&vm_thread_key, vm_thread_exit);
+}
+
+static inline void vm_thread_register(void)
+{
+    if(thread_registered) return;
+
+    pthread_once(&vm_thread_key_once, vm_thread_key_init);
+    pthread_setspecific(vm_thread_key, &thread_registered);
+    thread_registered = true;
+
+    pthread_mutex_lock(&stats_lock);
+    stat_shard.mag_count = &frame_mag.count;
+    stat_shard.next = stat_shards;
+    stat_shard.pprev = &stat_shards;
+    if(stat_shards != NULL) stat_shards->pprev = &stat_shard.next;
+    stat_shards = &stat_shard;
+    pthread_mutex_unlock(&stats_lock);
+
+    pthread_mutex_lock(&reclaim_lock);
+    walker.next = walkers;
+    walker.pprev = &walkers;
+    if(walkers != NULL) walkers->pprev = &walker.next;
+    walkers = &walker;
+    pthread_mutex_unlock(&reclaim_lock);
+}
+
+/*
+ * walk_begin() / walk_end()
+ * -------------------------
+ * Bracket a lock-free use of page tables: a walk, a TLB hit, and any read
+ * of the PTE they return. The outermost walk_begin() announces the current
+ * reclaim epoch, re-reading it until the announcement is known to be
+ * visible to pgtbl_retire(); walk_end() withdraws it. Calls nest.
+ */
+static inline void walk_begin(void)
+{
+    if(walker.depth++ > 0) return;
+    vm_thread_register();
+
+    uint64_t epoch;
+    do {
+      epoch = __atomic_load_n(&reclaim_epoch, __ATOMIC_SEQ_CST);
+      __atomic_store_n(&walker.epoch, epoch, __ATOMIC_SEQ_CST);
+    } while(__atomic_load_n(&reclaim_epoch, __ATOMIC_SEQ_CST) != epoch);
+}
+
+static inline void walk_end(void)
+{
+    if(--walker.depth > 0) return;
+    __atomic_store_n(&walker.epoch, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * l1_tlb_check()
+ * --------------
+ * Looks up a page of the current space, given its vpn and superpage number,
+ * in the calling thread's private TLB, under its page tag first and then
+ * its superpage tag. Drops every entry first if a shootdown happened since the
+ * L1 was last filled.
+ *
+ * Return: pointer to the PTE (or superpage PDE) on hit; NULL on miss.
+ */
+static inline pte_t* l1_tlb_check(vaddr_t vpn, vaddr_t spn)
+{
+    uint64_t gen = __atomic_load_n(&tlb_gen, __ATOMIC_ACQUIRE);
+    if(l1_tlb.gen != gen) {
+      memset(l1_tlb.pte, 0, sizeof(l1_tlb.pte));
+      l1_tlb.gen = gen;
+      return NULL;
+    }
+
+    uint16_t asid = cur_space->asid;
+    vaddr_t tags[2] = { vpn, TLB_LARGE_TAG | spn };
+    for(int t = 0; t < 2; t++) {
+      uint32_t idx = (tags[t] ^ asid) & (L1_TLB_ENTRIES - 1);
+      if(l1_tlb.pte[idx] != NULL && l1_tlb.vpn[idx] == tags[t] &&
+         l1_tlb.asid[idx] == asid) {
+        STAT_ADD(l1_hits, 1);
+        return l1_tlb.pte[idx];
+      }
+    }
+    return NULL;
+}
+
+/*
+ * l1_tlb_add()
+ * ------------
+ * Caches a translation in the calling thread's private TLB.
+ */
+static inline void l1_tlb_add(vaddr_t va, pte_t* pte)
+{
+    vm_thread_register();
+
+    uint16_t asid = cur_space->asid;
+    vaddr_t tag = tlb_tag(va, pte);
+    uint32_t idx = (tag ^ asid) & (L1_TLB_ENTRIES - 1);
+    l1_tlb.vpn[idx] = tag;
+    l1_tlb.asid[idx] = asid;
+    l1_tlb.pte[idx] = pte;
+}
+
+/*
+ * tlb_shootdown()
+ * ---------------
+ * Invalidates the private L1 TLB of every thread. Each thread notices the new
+ * generation on its next lookup and flushes before trusting any entry.
+ */
+static inline void tlb_shootdown(void)
+{
+    __atomic_fetch_add(&tlb_gen, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * tlb_set_begin() / tlb_set_end()
+ * -------------------------------
+ * Bracket a change to a TLB set. The sequence number is odd in between, so
+ * lock-free probes that overlap the change retry (see tlb_probe()). Caller
+ * holds lock, and stores every field a probe reads atomically in between.
+ */
+static inline void tlb_set_begin(struct tlb_set* ts)
+{
+    __atomic_store_n(&ts->seq, ts->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void tlb_set_end(struct tlb_set* ts)
+{
+    __atomic_store_n(&ts->seq, ts->seq + 1, __ATOMIC_RELEASE);
+}
+
+// drops the ways of a set whose bits are set in mask. caller holds lock.
+static void tlb_set_drop(struct tlb_set* ts, uint32_t mask)
+{
+    if(mask == 0) return;
+    tlb_set_begin(ts);
+    for(int w = 0; w < TLB_WAYS; w++) {
+      if(mask & (1u << w)) __atomic_store_n(&ts->in_use[w], false, __ATOMIC_RELAXED);
+    }
+    tlb_set_end(ts);
+}
+
+/*
+ * tlb_flush_asid()
+ * ----------------
+ * Drops every cached translation of one address space, before its ASID is
+ * handed to a new space.
+ */
+static void tlb_flush_asid(uint16_t asid)
+{
+    pthread_mutex_lock(&lock);
+    for(uint32_t set = 0; set < TLB_SETS; set++) {
+      struct tlb_set* ts = &tlb_store.sets[set];
+      uint32_t mask = 0;
+      for(int w = 0; w < TLB_WAYS; w++) {
+        if(ts->in_use[w] && ts->asid[w] == asid) mask |= 1u << w;
+      }
+      tlb_set_drop(ts, mask);
+    }
+    pthread_mutex_unlock(&lock);
+
+    tlb_shootdown();
+}
+
+/*
+ * tlb_drop_set()
+ * --------------
+ * Drops the ways of one set that cache a page of the current space in
+ * [vpn_lo, vpn_hi), under either its page tag or a superpage tag covering
+ * it. Caller holds lock.
+ */
+static void tlb_drop_set(uint32_t set, uint16_t asid, vaddr_t vpn_lo, vaddr_t vpn_hi)
+{
+    struct tlb_set* ts = &tlb_store.sets[set];
+    uint32_t mask = 0;
+    for(int w = 0; w < TLB_WAYS; w++) {
+      if(!ts->in_use[w] || ts->asid[w] != asid) continue;
+
+      vaddr_t tag = ts->vpn[w];
+      vaddr_t lo = tag, hi = tag + 1;
+      if(tag & TLB_LARGE_TAG) {
+        lo = (tag & ~TLB_LARGE_TAG) << PTX_BITS;
+        hi = lo + PGS_PER_SUPERPAGE;
+      }
+      if(lo < vpn_hi && hi > vpn_lo) mask |= 1u << w;
+    }
+    tlb_set_drop(ts, mask);
+}
+
+/*
+ * tlb_invalidate_range()
+ * ----------------------
+ * Drops every cached translation of num_pages pages of the current space
+ * starting at va_base, so freed pages stop taking up ways and no entry
+ * outlives the page table it points into. A short range probes only the
+ * sets its page and superpage tags hash to; a long one sweeps the TLB.
+ */
+static void tlb_invalidate_range(vaddr_t va_base, uint32_t num_pages)
+{
+    if(num_pages == 0) return;
+
+    uint16_t asid = cur_space->asid;
+    vaddr_t vpn_lo = va_base >> OFFSET_BITS;
+    vaddr_t vpn_hi = vpn_lo + num_pages;
+
+    pthread_mutex_lock(&lock);
+    if(num_pages <= TLB_SETS) {
+      for(vaddr_t vpn = vpn_lo; vpn < vpn_hi; vpn++) {
+        tlb_drop_set(tlb_set_idx(vpn, asid), asid, vpn_lo, vpn_hi);
+      }
+      for(vaddr_t spn = vpn_lo >> PTX_BITS; spn <= (vpn_hi - 1) >> PTX_BITS; spn++) {
+        tlb_drop_set(tlb_set_idx(TLB_LARGE_TAG | spn, asid), asid, vpn_lo, vpn_hi);
+      }
+    } else {
+      for(uint32_t set = 0; set < TLB_SETS; set++) {
+        tlb_drop_set(set, asid, vpn_lo, vpn_hi);
+      }
+    }
+    pthread_mutex_unlock(&lock);
+
+    tlb_shootdown();
+}
+
+/*
+ * tlb_insert()
+ * ------------
+ * Upserts a translation of the current address space into its set. If the
+ * set is full, the CLOCK hand gives each referenced way a second chance
+ * (clearing its bit) and evicts the first one that has not been hit since
+ * the hand last passed. A prefetched translation never overwrites an entry
+ * that is already cached, and starts out unreferenced, so it is the first
+ * to go if it is never used. Caller holds lock.
+ *
+ * Return: 1 if a new entry was inserted, 0 if the tag was already cached.
+ */
+static int tlb_insert(vaddr_t va, pte_t* pte_ptr, bool prefetch)
+{
+    vaddr_t vpn = tlb_tag(va, pte_ptr);
+    uint16_t asid = cur_space->asid;
+
+    struct tlb_set* ts = &tlb_store.sets[tlb_set_idx(vpn, asid)];
+    int free_way = -1;
+
+    // upsert the entry. while probing, remember the first free way.
+    for(int w = 0; w < TLB_WAYS; w++) {
+      if(!ts->in_use[w]) {
+        if(free_way == -1) free_way = w;
+        continue;
+      }
+
+      if(ts->vpn[w] == vpn && ts->asid[w] == asid) {
+        if(!prefetch) {
+          tlb_set_begin(ts);
+          __atomic_store_n(&ts->pte[w], pte_ptr, __ATOMIC_RELAXED);
+          tlb_set_end(ts);
+          __atomic_store_n(&ts->prefetched[w], false, __ATOMIC_RELAXED);
+          __atomic_store_n(&ts->referenced[w], true, __ATOMIC_RELAXED);
+        }
+        return 0;
+      }
+    }
+
+    int victim = free_way;
+    if(victim == -1) {
+      // a full turn at most: hits racing with the sweep may set bits again.
+      // a way loses its prefetched mark with its bit, so that a prefetch is
+      // only counted as a hit once.
+      for(int i = 0; i < TLB_WAYS &&
+                     __atomic_load_n(&ts->referenced[ts->hand], __ATOMIC_RELAXED); i++) {
+        __atomic_store_n(&ts->referenced[ts->hand], false, __ATOMIC_RELAXED);
+        __atomic_store_n(&ts->prefetched[ts->hand], false, __ATOMIC_RELAXED);
+        ts->hand = (ts->hand + 1) % TLB_WAYS;
+      }
+      victim = ts->hand;
+      ts->hand = (ts->hand + 1) % TLB_WAYS;
+      STAT_ADD(tlb_evictions, 1);
+    }
+
+    tlb_set_begin(ts);
+    __atomic_store_n(&ts->vpn[victim], vpn, __ATOMIC_RELAXED);
+    __atomic_store_n(&ts->asid[victim], asid, __ATOMIC_RELAXED);
+    __atomic_store_n(&ts->pte[victim], pte_ptr, __ATOMIC_RELAXED);
+    __atomic_store_n(&ts->in_use[victim], true, __ATOMIC_RELAXED);
+    tlb_set_end(ts);
+    __atomic_store_n(&ts->prefetched[victim], prefetch, __ATOMIC_RELAXED);
+    __atomic_store_n(&ts->referenced[victim], !prefetch, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/*
+ * TLB_add()
+ * ---------
+ * Adds a new virtual-to-physical translation of the current address space
+ * to the TLB, tagged with its ASID.
+ * Ensure thread safety when updating shared TLB data.
+ *
+ * Return:
+ *   0  -> Success (translation successfully added)
+ *  -1  -> Failure (e.g., invalid input)
+ */
+int TLB_add(void *va, void *pa)
+{
+    pte_t* pte_ptr = (pte_t*)pa;
+    if(pte_ptr == NULL) return -1;
+
+    pthread_mutex_lock(&lock);
+    tlb_insert(VA2U(va), pte_ptr, false);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+/*
+ * tlb_probe()
+ * -----------
+ * Looks for a tag of the given ASID in one set without taking lock. The ways
+ * are read between two loads of the set's sequence number, and the probe is
+ * repeated if a writer changed the set meanwhile. While a writer is inside
+ * the set, the probe waits for it on lock rather than spinning.
+ *
+ * Return: the way holding the tag, with its PTE pointer in *pte; -1 if none.
+ */
+static inline int tlb_probe(struct tlb_set* ts, vaddr_t tag, uint16_t asid, pte_t** pte)
+{
+    for(;;) {
+      uint32_t seq = __atomic_load_n(&ts->seq, __ATOMIC_ACQUIRE);
+      if(seq & 1) {
+        pthread_mutex_lock(&lock);
+        pthread_mutex_unlock(&lock);
+        continue;
+      }
+
+      int way = -1;
+      pte_t* hit = NULL;
+      for(int w = 0; w < TLB_WAYS; w++) {
+        if(__atomic_load_n(&ts->in_use[w], __ATOMIC_RELAXED) &&
+           __atomic_load_n(&ts->vpn[w], __ATOMIC_RELAXED) == tag &&
+           __atomic_load_n(&ts->asid[w], __ATOMIC_RELAXED) == asid) {
+          way = w;
+          hit = __atomic_load_n(&ts->pte[w], __ATOMIC_RELAXED);
+          break;
+        }
+      }
+
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if(__atomic_load_n(&ts->seq, __ATOMIC_RELAXED) == seq) {
+        *pte = hit;
+        return way;
+      }
+    }
+}
+
+/*
+ * tlb_lookup()
+ * ------------
+ * TLB_check() on an already decoded address: looks up the page with the
+ * given vpn and superpage number. A hit writes shared memory only the first
+ * time the way is hit after the CLOCK hand passed it, to set its referenced
+ * bit, so hits on a hot translation from many threads only read.
+ */
+static pte_t* tlb_lookup(vaddr_t vpn, vaddr_t spn)
+{
+    uint16_t asid = cur_space->asid;
+    vaddr_t tags[2] = { vpn, TLB_LARGE_TAG | spn };
+
+    // only the ways of the target set can hold a tag. a page may be cached
+    // under its own vpn or, if it lies in a superpage, under the large tag.
+    for(int t = 0; t < 2; t++) {
+      struct tlb_set* ts = &tlb_store.sets[tlb_set_idx(tags[t], asid)];
+      pte_t* hit;
+      int w = tlb_probe(ts, tags[t], asid, &hit);
+      if(w < 0) continue;
+
+      // the way may have been reused since the probe; then the bits land on
+      // its new entry, which only makes recency a little less exact
+      if(!__atomic_load_n(&ts->referenced[w], __ATOMIC_RELAXED)) {
+        if(__atomic_load_n(&ts->prefetched[w], __ATOMIC_RELAXED)) {
+          STAT_ADD(tlb_prefetch_hits, 1);
+        }
+        __atomic_store_n(&ts->referenced[w], true, __ATOMIC_RELAXED);
+      }
+      STAT_ADD(tlb_hits, 1);
+      return hit;
+    }
+
+    STAT_ADD(tlb_misses, 1);
+    return NULL; 
+}
+
+/*
+ * TLB_check()
+ * -----------
+ * Looks up a virtual address of the current address space in the TLB.
+ 
+ * Return:
+ *   Pointer to the corresponding page table entry (PTE) if found.
+ *   NULL if the translation is not found (TLB miss).
+ */
+pte_t *TLB_check(void *va)
+{
+    vaddr_t va_u = VA2U(va);
+    return tlb_lookup(va_u >> OFFSET_BITS, va_u >> PDXSHIFT);
+}
+
+// per-thread stream detector of the TLB prefetcher, fed by the pages of the
+// thread's L1 misses (see tlb_prefetch_note())
+struct tlb_stream {
+  vaddr_t last_vpn;      // page of the previous L1 miss
+  int32_t stride;        // distance from the miss before it, in pages
+  uint32_t ahead;        // strides past last_vpn already preloaded
+};
+
+static __thread struct tlb_stream tlb_stream;
+
+/*
+ * tlb_entry_current()
+ * -------------------
+ * Re-walks va in the current space and checks that it still leads to entry
+ * and that entry maps a page. Caller holds lock and found entry by a
+ * lock-free walk. n_free() unhooks a table and clears its entries before
+ * its tlb_invalidate_range() takes lock, so an entry that still checks out
+ * here is either dropped by that invalidation or was never freed; one that
+ * does not must not be cached, or it would outlive its page table.
+ */
+static bool tlb_entry_current(vaddr_t va, pte_t* entry)
+{
+    pde_t* pgdir = pgdir_of(cur_space->pgdir, va, false);
+    if(pgdir == NULL) return false;
+
+    pde_t* pde = &pgdir[PDX(va)];
+    pde_t pgdir_entry = __atomic_load_n(pde, __ATOMIC_ACQUIRE);
+    if(!(pgdir_entry & IN_USE)) return false;
+    if(pgdir_entry & PDE_LARGE) return entry == pde;
+
+    pte_t* pgtbl = (pte_t*)((char*)p_buff + (pgdir_entry & ~OFFMASK));
+    return entry == &pgtbl[PTX(va)] && (__atomic_load_n(entry, __ATOMIC_ACQUIRE) & IN_USE);
+}
+
+/*
+ * tlb_prefetch()
+ * --------------
+ * Preloads the translations of pages vpn + k * stride, for k in (from, to],
+ * into the shared TLB. The page table is walked lock-free like translate()
+ * does, inside the caller's walk. The stream stops at the first page that
+ * is not mapped, or at either end of the address space. It cannot tell
+ * allocations apart, so a neighbouring allocation that follows without a
+ * gap may have translations preloaded, never its pages touched. The batch
+ * is re-checked and inserted under a single lock hold, without displacing
+ * translations that are already cached. Pages are not marked referenced
+ * until they are actually used.
+ */
+static void tlb_prefetch(vaddr_t vpn, int32_t stride, uint32_t from, uint32_t to)
+{
+    pde_t* root = cur_space->pgdir;
+    vaddr_t vas[TLB_PREFETCH_DEPTH];
+    pte_t* ptes[TLB_PREFETCH_DEPTH];
+    int n = 0;
+
+    for(uint32_t k = from + 1; k <= to; k++) {
+      int64_t target = (int64_t)vpn + (int64_t)k * stride;
+      if(target < 0 || target >= NUM_VPAGES) break;
+
+      vaddr_t va = (vaddr_t)target << OFFSET_BITS;
+      pde_t* pgdir = pgdir_of(root, va, false);
+      if(pgdir == NULL) break;
+      uint32_t pgdir_idx = PDX(va);
+      pde_t pgdir_entry = __atomic_load_n(&pgdir[pgdir_idx], __ATOMIC_ACQUIRE);
+      if(!(pgdir_entry & IN_USE)) break;
+
+      pte_t* entry = &pgdir[pgdir_idx];
+      if(!(pgdir_entry & PDE_LARGE)) {
+        pte_t* pgtbl = (pte_t*)((char*)p_buff + (pgdir_entry & ~OFFMASK));
+        entry = &pgtbl[PTX(va)];
+        if(!(__atomic_load_n(entry, __ATOMIC_ACQUIRE) & IN_USE)) break;
+      }
+      vas[n] = va;
+      ptes[n++] = entry;
+    }
+    if(n == 0) return;
+
+    // the pages may have been freed since the walk
+    int added = 0;
+    pthread_mutex_lock(&lock);
+    for(int i = 0; i < n; i++) {
+      if(tlb_entry_current(vas[i], ptes[i])) added += tlb_insert(vas[i], ptes[i], true);
+    }
+    pthread_mutex_unlock(&lock);
+    STAT_ADD(tlb_prefetches, added);
+}
+
+/*
+ * tlb_prefetch_note()
+ * -------------------
+ * Feeds a page that missed the calling thread's L1 TLB to its stream
+ * detector. A miss one known stride past the previous one confirms the
+ * stream and tops the preloaded window back up to TLB_PREFETCH_DEPTH strides
+ * ahead, so a steady stream costs one page-table lookup per miss. Any other
+ * distance becomes the stride to confirm next; repeated misses on the same
+ * page are ignored.
+ */
+static void tlb_prefetch_note(vaddr_t vpn)
+{
+    int32_t delta = (int32_t)(vpn - tlb_stream.last_vpn);
+    if(delta == 0) return;
+    tlb_stream.last_vpn = vpn;
+
+    if(delta != tlb_stream.stride) {
+      tlb_stream.stride = delta;
+      tlb_stream.ahead = 0;
+      return;
+    }
+    if(delta > TLB_PREFETCH_MAX_STRIDE || delta < -TLB_PREFETCH_MAX_STRIDE) return;
+
+    // this miss used up one stride of the window
+    uint32_t ahead = tlb_stream.ahead > 0 ? tlb_stream.ahead - 1 : 0;
+    tlb_prefetch(vpn, delta, ahead, TLB_PREFETCH_DEPTH);
+    tlb_stream.ahead = TLB_PREFETCH_DEPTH;
+}
+
+/*
+ * print_TLB_missrate()
+ * --------------------
+ * Calculates and prints the TLB miss rate.
+ *
+ * Return value: None.
+ */
+void print_TLB_missrate(void)
+{
+    double miss_rate;
+    struct vm_stats stats;
+    vm_get_stats(&stats);
+
+    if(stats.tlb_lookups > 0) {
+      miss_rate = (double)stats.tlb_misses / stats.tlb_lookups;
+    } else {
+      miss_rate = 0.0;
+    }
+    
+    fprintf(stderr, "TLB miss rate %lf \n", miss_rate);
+    fprintf(stderr, "TLB Lookups: %llu\n", stats.tlb_lookups);
+    fprintf(stderr, "TLB Misses:  %llu\n", stats.tlb_misses);
+    fprintf(stderr, "TLB Hits:    %llu\n", stats.tlb_lookups - stats.tlb_misses);
+    fprintf(stderr, "TLB Evictions: %llu\n", stats.tlb_evictions);
+    if(stats.tlb_prefetches > 0) {
+      fprintf(stderr, "TLB Prefetches: %llu (accuracy %.2f%%, coverage %.2f%%)\n",
+              stats.tlb_prefetches,
+              100.0 * stats.tlb_prefetch_hits / stats.tlb_prefetches,
+              100.0 * stats.tlb_prefetch_hits /
+                  (stats.tlb_prefetch_hits + stats.tlb_misses));
+    }
+    fprintf(stderr, "TLB miss rate: %lf (%.4f%%)\n", miss_rate, miss_rate * 100);
+    fprintf(stderr, "TLB hit rate:  %.4f%%\n", (1.0 - miss_rate) * 100);
+}
+
+// -----------------------------------------------------------------------------
+// Statistics
+// -----------------------------------------------------------------------------
+
+// adds one shard's counters to a stats snapshot
+static void stat_sum(struct vm_stats* out, struct stat_shard* sh)
+{
+  out->l1_hits += __atomic_load_n(&sh->l1_hits, __ATOMIC_RELAXED);
+  out->tlb_hits += __atomic_load_n(&sh->tlb_hits, __ATOMIC_RELAXED);
+  out->tlb_misses += __atomic_load_n(&sh->tlb_misses, __ATOMIC_RELAXED);
+  out->tlb_evictions += __atomic_load_n(&sh->tlb_evictions, __ATOMIC_RELAXED);
+  out->tlb_prefetches += __atomic_load_n(&sh->tlb_prefetches, __ATOMIC_RELAXED);
+  out->tlb_prefetch_hits += __atomic_load_n(&sh->tlb_prefetch_hits, __ATOMIC_RELAXED);
+  out->pgtbl_walks += __atomic_load_n(&sh->pgtbl_walks, __ATOMIC_RELAXED);
+  out->bytes_read += __atomic_load_n(&sh->bytes_read, __ATOMIC_RELAXED);
+  out->bytes_written += __atomic_load_n(&sh->bytes_written, __ATOMIC_RELAXED);
+}
+
+/*
+ * vm_get_stats()
+ * --------------
+ * Fills out with a snapshot of the library's counters: the per-thread shards
+ * summed up, plus frame and swap usage sampled from their bitmaps and the
+ * virtual page usage the current space keeps as it allocates. Counters of other threads are read without stopping them, so a
+ * snapshot taken under load is approximate.
+ *
+ * Return value: None.
+ */
+void vm_get_stats(struct vm_stats* out)
+{
+  if(out == NULL) return;
+  memset(out, 0, sizeof(*out));
+
+  uint32_t mag_frames = 0;
+  pthread_mutex_lock(&stats_lock);
+  stat_sum(out, &stat_retired);
+  for(struct stat_shard* sh = stat_shards; sh != NULL; sh = sh->next) {
+    stat_sum(out, sh);
+    mag_frames += __atomic_load_n(sh->mag_count, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&stats_lock);
+
+  // the caller's own shard is not linked yet if it never registered
+  if(!thread_registered) {
+    stat_sum(out, &stat_shard);
+    mag_frames += frame_mag.count;
+  }
+  out->tlb_lookups = out->l1_hits + out->tlb_hits + out->tlb_misses;
+
+  out->frames_total = MAX_NUM_FRAMES;
+  if(p_bmap == NULL) {
+    out->frames_free = MAX_NUM_FRAMES;
+    return;
+  }
+
+  // frames sitting in thread magazines are reserved in p_bmap but free
+  uint32_t reserved = 0;
+  pthread_mutex_lock(&frame_lock);
+  for(uint32_t w = 0; w < P_BMAP_WORDS; w++) {
+    reserved += __builtin_popcountll(((uint64_t*)p_bmap)[w]);
+  }
+  pthread_mutex_unlock(&frame_lock);
+  out->frames_used = reserved - mag_frames;
+  out->frames_free = MAX_NUM_FRAMES - out->frames_used;
+
+  pthread_mutex_lock(&swap_lock);
+  for(uint32_t w = 0; swap_bmap != NULL && w < SWAP_SLOTS / 64; w++) {
+    out->swap_pages += __builtin_popcountll(swap_bmap[w]);
+  }
+  pthread_mutex_unlock(&swap_lock);
+
+  // both are kept up to date by v_bmap_mark(); reading them without lock
+  // may pair a count from just before an allocation with a run from after
+  out->va_pages_free =
+      NUM_VPAGES - __atomic_load_n(&cur_space->vpages_used, __ATOMIC_RELAXED);
+  out->va_largest_free = NUM_VPAGES -
+      __atomic_load_n(&cur_space->v_tree->best[1], __ATOMIC_RELAXED);  // root shortfall
+
+  if(out->va_pages_free > 0) {
+    out->va_fragmentation = 1.0 - (double)out->va_largest_free / out->va_pages_free;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Page Table
+// -----------------------------------------------------------------------------
+
+#if VA_BITS == 48
+/*
+ * upper_next()
+ * ------------
+ * Follows entry idx of the root or of a p3 table to the table it names.
+ * With create, an empty entry first gets a zeroed table, published with a
+ * release store like a page table in pgtbl_upsert().
+ *
+ * Return: the table; NULL if there is none (or no frame is left for it).
+ */
+static pde_t* upper_next(pde_t* table, uint32_t idx, bool create)
+{
+  pde_t entry = __atomic_load_n(&table[idx], __ATOMIC_ACQUIRE);
+  if(!(entry & IN_USE) && create) {
+    pthread_mutex_lock(&upper_lock);
+    entry = table[idx];
+    if(!(entry & IN_USE)) {
+      pde_t* frame = alloc_frame();
+      if(frame != NULL) {
+        memset(frame, 0, PGSIZE);
+        entry = (pde_t)((char*)frame - (char*)p_buff) | PDE_TABLE | IN_USE;
+        __atomic_store_n(&table[idx], entry, __ATOMIC_RELEASE);
+      }
+    }
+    pthread_mutex_unlock(&upper_lock);
+  }
+  if(!(entry & IN_USE)) return NULL;
+  return (pde_t*)((char*)p_buff + (entry & ~OFFMASK));
+}
+#endif
+
+/*
+ * pgdir_of()
+ * ----------
+ * Returns the page directory that covers va in the space rooted at root.
+ * With 32-bit addresses that is the root itself; with 48-bit ones it is
+ * found through the p4 and p3 tables, which create adds as needed.
+ *
+ * Return: the page directory; NULL if it does not exist (or cannot be made).
+ */
+static inline pde_t* pgdir_of(pde_t* root, vaddr_t va, bool create)
+{
+#if VA_BITS == 32
+  (void)va;
+  (void)create;
+  return root;
+#else
+  pde_t* p3 = upper_next(root, P4X(va), create);
+  return (p3 == NULL) ? NULL : upper_next(p3, P3X(va), create);
+#endif
+}
+
+/*
+ * pgdir_next()
+ * ------------
+ * Finds the first page directory of the space rooted at root that covers
+ * addresses at or above *va (a multiple of PGDIR_SPAN), and moves *va to
+ * the base of its range. Used to visit every page directory in address
+ * order, stepping *va by PGDIR_SPAN.
+ *
+ * Return: the page directory; NULL once there is none left.
+ */
+static pde_t* pgdir_next(pde_t* root, uint64_t* va)
+{
+#if VA_BITS == 32
+  return (*va == 0) ? root : NULL;
+#else
+  uint64_t cur = *va;
+  while(cur < (1ull << VA_BITS)) {
+    pde_t* p3 = upper_next(root, P4X(cur), false);
+    if(p3 == NULL) {
+      cur = (P4X(cur) + 1) << P4SHIFT;
+      continue;
+    }
+    pde_t* pgdir = upper_next(p3, P3X(cur), false);
+    if(pgdir != NULL) {
+      *va = cur;
+      return pgdir;
+    }
+    cur += PGDIR_SPAN;
+  }
+  return NULL;
+#endif
+}
+
+/*
+ * upper_frames_each()
+ * -------------------
+ * Calls fn on the frame of every p3 table and page directory below root
+ * (not on root itself). Nothing to visit with 32-bit addresses.
+ */
+static void upper_frames_each(pde_t* root, void (*fn)(void* frame))
+{
+#if VA_BITS == 48
+  for(uint32_t i = 0; i < (1u << ROOT_BITS); i++) {
+    pde_t* p3 = upper_next(root, i, false);
+    if(p3 == NULL) continue;
+    for(uint32_t j = 0; j <= vm_layout.p3_mask; j++) {
+      pde_t* pgdir = upper_next(p3, j, false);
+      if(pgdir != NULL) fn(pgdir);
+    }
+    fn(p3);
+  }
+#else
+  (void)root;
+  (void)fn;
+#endif
+}
+
+/*
+ * translate_walk()
+ * ----------------
+ * translate() for a caller already inside walk_begin(), which keeps the
+ * page table behind the returned PTE from being reused until walk_end().
+ */
+static pte_t* translate_walk(pde_t* pgdir, void* va)
+{
+    // extract the virtual address and compute indices
+    // for the page directory, page table, and offset.
+    // return the corresponding PTE (i.e. p_frame) if found
+ 
+    vaddr_t v_addr = VA2U(va);
+
+    // decode the address once, up front: the layout never changes, but it
+    // would be reloaded after every lock and atomic access below. spn is
+    // the superpage number a superpage is cached under.
+    vaddr_t vpn = v_addr >> OFFSET_BITS;
+    vaddr_t spn = v_addr >> PDXSHIFT;
+    uint32_t pgdir_idx = PDX(v_addr);
+
+    // the TLBs cache the current address space only (under its ASID); a
+    // walk of any other page directory bypasses them
+    bool cached = (pgdir == cur_space->pgdir);
+
+    pte_t* cache_hit = cached ? l1_tlb_check(vpn, spn) : NULL;
+    if(cache_hit != NULL && tlb_entry_live(cache_hit)) {
+      pte_touch(cache_hit);
+      return cache_hit;
+    }
+
+    // past the L1, let the prefetcher see the access before the shared
+    // TLB is consulted. a stale hit falls through to the walk, which has
+    // the final say.
+    if(cached) tlb_prefetch_note(vpn);
+    cache_hit = cached ? tlb_lookup(vpn, spn) : NULL;
+    if(cache_hit != NULL && tlb_entry_live(cache_hit)) {
+      pte_touch(cache_hit);
+      l1_tlb_add(v_addr, cache_hit);
+      return cache_hit;
+    }
+
+    // tlb miss: lock-free walk. the acquire load of the PDE pairs with the
+    // release store in map_page(), so the page table it names is initialized.
+    STAT_ADD(pgtbl_walks, 1);
+    pgdir = pgdir_of(pgdir, v_addr, false);
+    if(pgdir == NULL) return NULL;
+    pde_t pgdir_entry = __atomic_load_n(&pgdir[pgdir_idx], __ATOMIC_ACQUIRE);
+    if(!(pgdir_entry & IN_USE)) return NULL;
+
+    // a superpage PDE is its own translation
+    pte_t* pgtbl_entry_ptr = &pgdir[pgdir_idx];
+    if(!(pgdir_entry & PDE_LARGE)) {
+      paddr_t pgtbl_offset = pgdir_entry & ~OFFMASK;
+      pte_t* pgtbl = (pte_t*)((char*)p_buff + pgtbl_offset); 
+
+      uint32_t pgtbl_idx = vpn & PXMASK;
+      pgtbl_entry_ptr = &(pgtbl[pgtbl_idx]);
+
+      if(!(__atomic_load_n(pgtbl_entry_ptr, __ATOMIC_ACQUIRE) & IN_USE)) {
+        return NULL;
+      }
+    }
+
+    // the shared TLB gets the entry only if no n_free() got in since the
+    // walk; the L1 needs no check, as the shootdown that n_free() ends with
+    // flushes it on the next l1_tlb_check()
+    pte_touch(pgtbl_entry_ptr);
+    if(cached) {
       pthread_mutex_lock(&lock);
-      set_bit(v_bmap, v_page_bit_idx);
+      if(tlb_entry_current(v_addr, pgtbl_entry_ptr)) tlb_insert(v_addr, pgtbl_entry_ptr, false);
       pthread_mutex_unlock(&lock);
+      l1_tlb_add(v_addr, pgtbl_entry_ptr);
+    }
+
+    return pgtbl_entry_ptr;
+}
+
+/*
+ * translate()
+ * -----------
+ * Translates a virtual address to a physical address.
+ * Perform a TLB lookup first; if not found, walk the page directory
+ * and page tables using a two-level lookup (four levels, for 48-bit
+ * addresses).
+ *
+ * Return:
+ *   Pointer to the PTE structure if translation succeeds.
+ *   NULL if translation fails (e.g., page not mapped).
+ */
+pte_t* translate(pde_t* pgdir, void* va)
+{
+    walk_begin();
+    pte_t* pte = translate_walk(pgdir, va);
+    walk_end();
+    return pte;
+}
+
+/*
+ * pgtbl_upsert()
+ * --------------
+ * Returns the page table behind a PDE, allocating and zeroing one first if
+ * the entry is empty or reserved. Caller holds pde_locks[pgdir_idx].
+ *
+ * Return: pointer to the page table; NULL if the PDE maps a superpage (its
+ *         frame holds data, not PTEs) or no frame is left for a table.
+ */
+static pte_t* pgtbl_upsert(pde_t* pgdir, uint32_t pgdir_idx)
+{
+    pde_t pgdir_entry = pgdir[pgdir_idx];
+    if(pgdir_entry & PDE_LARGE) return NULL;
+    if(!(pgdir_entry & IN_USE)) {
+      // allocate pgtbl and zero it. a reserved PDE hands its reservation
+      // down to every PTE of the new table instead.
+      pte_t* pgtbl_frame = alloc_frame();
+      if(pgtbl_frame == NULL) return NULL;
+
+      uint32_t pgdir_offset = (char*)pgtbl_frame - (char*)p_buff;
+      if(pgdir_entry & PTE_RESERVED) {
+        for(uint32_t i = 0; i < PGS_PER_SUPERPAGE; i++) pgtbl_frame[i] = PTE_RESERVED;
+        pgtbl_live[pgdir_offset >> OFFSET_BITS] = PGS_PER_SUPERPAGE;
+      } else {
+        memset(pgtbl_frame, 0, PGSIZE);
+        pgtbl_live[pgdir_offset >> OFFSET_BITS] = 0;
+      }
+      pgdir_entry = pgdir_offset | PDE_TABLE | IN_USE;
+
+      // publish the zeroed table to lock-free walkers
+      __atomic_store_n(&pgdir[pgdir_idx], pgdir_entry, __ATOMIC_RELEASE);
+    }
+
+    return (pte_t*)((char*)p_buff + (pgdir_entry & ~OFFMASK));
+}
+
+/*
+ * pgtbl_count()
+ * -------------
+ * Adjusts the count of entries in use of a page table by delta, as entries
+ * change between empty and non-empty. Caller holds the table's PDE lock.
+ */
+static inline void pgtbl_count(pte_t* pgtbl, int delta)
+{
+    pgtbl_live[((char*)pgtbl - (char*)p_buff) >> OFFSET_BITS] += delta;
+}
+
+/*
+ * pgtbl_reclaim()
+ * ---------------
+ * Unhooks the page table behind a PDE once none of its entries maps,
+ * reserves or swaps a page. Caller holds pde_locks[pgdir_idx]. TLB entries
+ * and lock-free walkers may still point into the table, so the caller runs
+ * tlb_invalidate_range() over the PDE's pages and then hands the frame to
+ * pgtbl_retire(), never straight back to the pool.
+ *
+ * Return: frame of the unhooked table; -1 if the PDE keeps it.
+ */
+static int64_t pgtbl_reclaim(pde_t* pgdir, uint32_t pgdir_idx)
+{
+    pde_t pgdir_entry = pgdir[pgdir_idx];
+    if(!(pgdir_entry & IN_USE) || (pgdir_entry & PDE_LARGE)) return -1;
+
+    uint32_t frame = (pgdir_entry & ~OFFMASK) >> OFFSET_BITS;
+    if(pgtbl_live[frame] != 0) return -1;
+
+    __atomic_store_n(&pgdir[pgdir_idx], 0, __ATOMIC_RELEASE);
+    return frame;
+}
+
+/*
+ * pgtbl_retire()
+ * --------------
+ * Takes the frames of n page tables unhooked by pgtbl_reclaim() (and out of
+ * the TLBs), tags them with the current reclaim epoch and advances it. Then
+ * hands back to the frame pool every retired table that no walker can still
+ * be reading: one retired before the oldest epoch announced by a walker. A
+ * table retired while walks were in flight stays on the list until a later
+ * call finds them finished.
+ */
+static void pgtbl_retire(const uint32_t* tables, uint32_t n)
+{
+    uint32_t ready[64];
+    uint32_t count = 0;
+
+    pthread_mutex_lock(&reclaim_lock);
+    if(retired_count + n > retired_cap) {
+      uint32_t new_cap = retired_cap ? retired_cap : 64;
+      while(new_cap < retired_count + n) new_cap *= 2;
+      struct retired_table* grown = realloc(retired, new_cap * sizeof(*grown));
+      if(grown != NULL) {
+        retired = grown;
+        retired_cap = new_cap;
+      }
+    }
+
+    // the tables are already unhooked, so a walker that announces the new
+    // epoch can no longer reach them
+    uint64_t epoch = __atomic_fetch_add(&reclaim_epoch, 1, __ATOMIC_SEQ_CST);
+    for(uint32_t i = 0; i < n; i++) {
+      // out of memory for the list: leak the table rather than reuse it
+      if(retired_count == retired_cap) break;
+      retired[retired_count].frame = tables[i];
+      retired[retired_count].epoch = epoch;
+      retired_count++;
+    }
+
+    uint64_t oldest = UINT64_MAX;
+    for(struct walker* w = walkers; w != NULL; w = w->next) {
+      uint64_t e = __atomic_load_n(&w->epoch, __ATOMIC_SEQ_CST);
+      if(e != 0 && e < oldest) oldest = e;
+    }
+
+    for(uint32_t i = 0; i < retired_count; ) {
+      if(retired[i].epoch >= oldest) {
+        i++;
+        continue;
+      }
+      ready[count++] = retired[i].frame;
+      retired[i] = retired[--retired_count];
+      if(count == sizeof(ready) / sizeof(ready[0])) {
+        frames_release(ready, count);
+        count = 0;
+      }
+    }
+    pthread_mutex_unlock(&reclaim_lock);
+
+    frames_release(ready, count);
+}
+
+/*
+ * map_page()
+ * -----------
+ * Establishes a mapping between a virtual and a physical page.
+ * Creates intermediate page tables if necessary.
+ *
+ * Return:
+ *   0  -> Success (mapping created)
+ *  -1  -> Failure (e.g., no space, or the page is already mapped,
+ *         reserved or swapped out)
+ */
+int map_page(pde_t *pgdir, void *va, void *pa)
+{
+    // TODO: map virtual address to physical address in the page tables.
+    // make this threadsafe
+    // check if there is an existing mapping for a virtual address
+    vaddr_t v_addr = VA2U(va);
+    uint32_t pgdir_idx = PDX(v_addr);
+    uint32_t pgtbl_idx = PTX(v_addr);
+
+    pgdir = pgdir_of(pgdir, v_addr, true);
+    if(pgdir == NULL) return -1;
+ 
+    pthread_mutex_lock(&pde_locks[pgdir_idx]);
+    pte_t* pgtbl = pgtbl_upsert(pgdir, pgdir_idx);
+    if(pgtbl == NULL) {
+      pthread_mutex_unlock(&pde_locks[pgdir_idx]);
+      return -1;
+    }
+
+    // a reserved or swapped-out entry is not free: mapping over it would
+    // drop its demand-paging state or leak its swap slot
+    if(pgtbl[pgtbl_idx] == 0) {
+      uint32_t pa_offset = (char*)pa - (char*)p_buff;
+      frame_owner[pa_offset >> OFFSET_BITS] = (v_addr & ~OFFMASK) | cur_space->asid;
+      pgtbl_count(pgtbl, 1);
+      __atomic_store_n(&pgtbl[pgtbl_idx], pa_offset | IN_USE, __ATOMIC_RELEASE);
+
+      pthread_mutex_unlock(&pde_locks[pgdir_idx]);
+      tlb_shootdown();
+      return 0;
+    }
+
+    pthread_mutex_unlock(&pde_locks[pgdir_idx]);
+    return -1;
+
+}
+
+/*
+ * map_superpage()
+ * ---------------
+ * Maps the whole region of the empty PDE covering va onto PGS_PER_SUPERPAGE
+ * fresh, physically contiguous frames.
+ *
+ * Return:
+ *   0  -> Success (PDE now has PDE_LARGE set)
+ *  -1  -> Failure (PDE already in use or reserved, or no contiguous run
+ *         of frames)
+ */
+static int map_superpage(pde_t* pgdir, vaddr_t va)
+{
+    uint32_t pgdir_idx = PDX(va);
+    int64_t first = frames_reserve_large();
+    if(first < 0) return -1;
+
+    pthread_mutex_lock(&pde_locks[pgdir_idx]);
+    if(pgdir[pgdir_idx] != 0) {
+      pthread_mutex_unlock(&pde_locks[pgdir_idx]);
+      frames_release_run(first, PGS_PER_SUPERPAGE);
+      return -1;
+    }
+
+    pde_t pgdir_entry = ((uint32_t)first * PGSIZE) | PDE_LARGE | IN_USE;
+    __atomic_store_n(&pgdir[pgdir_idx], pgdir_entry, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pde_locks[pgdir_idx]);
+    return 0;
+}
+
+/*
+ * unmap_superpage()
+ * -----------------
+ * Clears the superpage PDE covering va and returns its frames to p_bmap,
+ * except pinned ones, which are released by their last n_unpin().
+ *
+ * Return: true if this call removed the superpage; false if the PDE was not
+ *         (or no longer) a superpage.
+ */
+static bool unmap_superpage(pde_t* pgdir, vaddr_t va)
+{
+    uint32_t pgdir_idx = PDX(va);
+    pthread_mutex_lock(&pde_locks[pgdir_idx]);
+    pde_t old_pde = pgdir[pgdir_idx];
+    if(!(old_pde & PDE_LARGE)) {
+      pthread_mutex_unlock(&pde_locks[pgdir_idx]);
+      return false;
+    }
+    __atomic_store_n(&pgdir[pgdir_idx], 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pde_locks[pgdir_idx]);
+
+    uint32_t first = (old_pde & ~OFFMASK) >> OFFSET_BITS;
+    uint32_t frames[MAX_PGS_PER_SUPERPAGE];
+    uint32_t n = 0;
+    for(uint32_t i = 0; i < PGS_PER_SUPERPAGE; i++) {
+      if(frame_retire(first + i)) frames[n++] = first + i;
+    }
+    frames_release(frames, n);
+    return true;
+}
+
+/*
+ * split_superpage()
+ * -----------------
+ * Replaces the superpage PDE covering va with a page table mapping the same
+ * frames, so that its pages can be freed one at a time.
+ *
+ * Return: 0 on success (or if already split); -1 if no frame is left for
+ *         the page table.
+ */
+static int split_superpage(pde_t* pgdir, vaddr_t va)
+{
+    uint32_t pgdir_idx = PDX(va);
+    vaddr_t span = (va >> PDXSHIFT) << PDXSHIFT;
+    pthread_mutex_lock(&pde_locks[pgdir_idx]);
+    pde_t old_pde = pgdir[pgdir_idx];
+    if(!(old_pde & PDE_LARGE)) {
+      pthread_mutex_unlock(&pde_locks[pgdir_idx]);
+      return 0;
+    }
+
+    pte_t* pgtbl = alloc_frame();
+    if(pgtbl == NULL) {
+      pthread_mutex_unlock(&pde_locks[pgdir_idx]);
+      return -1;
+    }
+
+    // the frames become ordinary pages, which swap_out() may now evict
+    paddr_t base = old_pde & ~OFFMASK;
+    for(uint32_t i = 0; i < PGS_PER_SUPERPAGE; i++) {
+      pgtbl[i] = (base + i * PGSIZE) | IN_USE;
+      frame_owner[(base >> OFFSET_BITS) + i] = (span + i * PGSIZE) | cur_space->asid;
+    }
+    pgtbl_live[((char*)pgtbl - (char*)p_buff) >> OFFSET_BITS] = PGS_PER_SUPERPAGE;
+
+    pde_t pgdir_entry = ((char*)pgtbl - (char*)p_buff) | PDE_TABLE | IN_USE;
+    __atomic_store_n(&pgdir[pgdir_idx], pgdir_entry, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pde_locks[pgdir_idx]);
+
+    tlb_shootdown();
+    return 0;
+}
+
+/*
+ * unmap_range()
+ * -------------
+ * Clears the PTEs of num_pages consecutive virtual pages and hands their
+ * frames straight back to p_bmap, along with any page table left empty.
+ * Used to roll back a partial map_range().
+ */
+static void unmap_range(vaddr_t va_base, uint32_t num_pages)
+{
+    pde_t* root = cur_space->pgdir;
+    uint32_t frames[MAX_PGS_PER_SUPERPAGE];
+    uint32_t tables[1 << MAX_PDX_BITS];
+    uint32_t done = 0, reclaimed = 0;
+
+    while(done < num_pages) {
+      vaddr_t v_addr = va_base + done * PGSIZE;
+      uint32_t pgdir_idx = PDX(v_addr);
+      uint32_t first = PTX(v_addr);
+      uint32_t n = (1u << PTX_BITS) - first;
+      if(n > num_pages - done) n = num_pages - done;
+
+      // map_range() only installs superpages over whole page-table spans
+      pde_t* pgdir = pgdir_of(root, v_addr, false);
+      if(pgdir == NULL || unmap_superpage(pgdir, v_addr)) {
+        done += n;
+        continue;
+      }
+
+      pde_t pgdir_entry = __atomic_load_n(&pgdir[pgdir_idx], __ATOMIC_ACQUIRE);
+      pte_t* pgtbl = (pte_t*)((char*)p_buff + (pgdir_entry & ~OFFMASK));
+      uint32_t freed = 0;
+
+      pthread_mutex_lock(&pde_locks[pgdir_idx]);
+      for(uint32_t i = 0; i < n; i++) {
+        pte_t old_pte = __atomic_exchange_n(&pgtbl[first + i], 0, __ATOMIC_ACQ_REL);
+        uint32_t frame = (old_pte & ~OFFMASK) >> OFFSET_BITS;
+        if(old_pte != 0) pgtbl_count(pgtbl, -1);
+        if((old_pte & IN_USE) && frame_retire(frame)) frames[freed++] = frame;
+      }
+      int64_t table = pgtbl_reclaim(pgdir, pgdir_idx);
+      if(table >= 0) tables[reclaimed++] = table;
+      pthread_mutex_unlock(&pde_locks[pgdir_idx]);
+
+      frames_release(frames, freed);
+      done += n;
+    }
+
+    tlb_invalidate_range(va_base, num_pages);
+    if(reclaimed > 0) pgtbl_retire(tables, reclaimed);
+}
+
+/*
+ * map_range()
+ * -----------
+ * Backs num_pages consecutive virtual pages starting at va_base with fresh
+ * frames. Each whole, empty PDE span is mapped as a superpage when a
+ * contiguous run of frames is available. Otherwise frames are taken in
+ * bulk, one batch per page table, and all PTEs that fall in the same page
+ * table are filled under a single hold of its PDE lock. On failure the pages
+ * mapped so far are rolled back.
+ *
+ * Return:
+ *   0  -> Success (every page mapped)
+ *  -1  -> Failure (out of frames or a page was already mapped or reserved)
+ */
+static int map_range(vaddr_t va_base, uint32_t num_pages)
+{
+    pde_t* root = cur_space->pgdir;
+    uint32_t frames[MAX_PGS_PER_SUPERPAGE];
+    uint32_t mapped = 0;
+
+    while(mapped < num_pages) {
+      vaddr_t v_addr = va_base + mapped * PGSIZE;
+      uint32_t pgdir_idx = PDX(v_addr);
+      uint32_t first = PTX(v_addr);
+      uint32_t n = (1u << PTX_BITS) - first;
+      if(n > num_pages - mapped) n = num_pages - mapped;
+
+      pde_t* pgdir = pgdir_of(root, v_addr, true);
+      if(pgdir == NULL) break;
+      if(n == PGS_PER_SUPERPAGE && map_superpage(pgdir, v_addr) == 0) {
+        mapped += n;
+        continue;
+      }
+
+      if(frames_take(frames, n) == -1) break;
+
+      pthread_mutex_lock(&pde_locks[pgdir_idx]);
+      pte_t* pgtbl = pgtbl_upsert(pgdir, pgdir_idx);
+      bool clear = (pgtbl != NULL);
+      for(uint32_t i = 0; clear && i < n; i++) {
+        if(pgtbl[first + i] != 0) clear = false;
+      }
+
+      if(!clear) {
+        pthread_mutex_unlock(&pde_locks[pgdir_idx]);
+        frames_release(frames, n);
+        break;
+      }
+
+      for(uint32_t i = 0; i < n; i++) {
+        pte_t entry = (frames[i] * PGSIZE) | IN_USE;
+        frame_owner[frames[i]] = (v_addr + i * PGSIZE) | cur_space->asid;
+        __atomic_store_n(&pgtbl[first + i], entry, __ATOMIC_RELEASE);
+      }
+      pgtbl_count(pgtbl, n);
+      pthread_mutex_unlock(&pde_locks[pgdir_idx]);
+
+      mapped += n;
+    }
+
+    if(mapped < num_pages) {
+      unmap_range(va_base, mapped);
+      return -1;
+    }
+
+    tlb_shootdown();
+    return 0;
+}
+
+/*
+ * back_page()
+ * -----------
+ * Gives a page without a frame one: a reserved page gets a zeroed frame, a
+ * swapped-out page gets its contents back from swap. Caller holds the PDE
+ * lock of the page.
+ *
+ * Return: 0 on success, -1 if out of frames or the swap read failed.
+ */
+static int back_page(pte_t* entry, vaddr_t va)
+{
+    pte_t old_entry = *entry;
+    void* frame = alloc_frame();
+    if(frame == NULL) return -1;
+
+    uint32_t slot = (old_entry & ~OFFMASK) >> OFFSET_BITS;
+    if(!(old_entry & PTE_SWAPPED)) {
+      memset(frame, 0, PGSIZE);
+    } else if(swap_read(slot, frame) == -1) {
+      free_frame(frame);
+      return -1;
+    }
+
+    uint32_t pa_offset = (char*)frame - (char*)p_buff;
+    frame_owner[pa_offset >> OFFSET_BITS] = (va & ~OFFMASK) | cur_space->asid;
+    __atomic_store_n(entry, pa_offset | IN_USE, __ATOMIC_RELEASE);
+
+    if(old_entry & PTE_SWAPPED) swap_slot_free(slot);
+    return 0;
+}
+
+/*
+ * fault_in()
+ * ----------
+ * Page fault: gives a page reserved by n_malloc_lazy() its frame on first
+ * access, and reads a swapped-out page back in. No TLB holds a live
+ * translation for a page without a frame, so nothing needs to be shot down.
+ *
+ * Return: 0 if the page is backed now (or already was); -1 if it is neither
+ *         reserved nor swapped, or no frame is left.
+ */
+static int fault_in(vaddr_t va)
+{
+    pde_t* pgdir = pgdir_of(cur_space->pgdir, va, false);
+    uint32_t pgdir_idx = PDX(va);
+    int ret = -1;
+    if(pgdir == NULL) return -1;
+
+    pthread_mutex_lock(&pde_locks[pgdir_idx]);
+    pde_t pgdir_entry = pgdir[pgdir_idx];
+    if(pgdir_entry & PDE_LARGE) {
+      ret = 0;
+    } else if(pgdir_entry & (IN_USE | PTE_RESERVED)) {
+      pte_t* pgtbl = pgtbl_upsert(pgdir, pgdir_idx);
+      if(pgtbl != NULL) {
+        pte_t* entry = &pgtbl[PTX(va)];
+        if(*entry & IN_USE) ret = 0;
+        else if(*entry & (PTE_RESERVED | PTE_SWAPPED)) ret = back_page(entry, va);
+      }
+    }
+    pthread_mutex_unlock(&pde_locks[pgdir_idx]);
+
+    return ret;
+}
+
+/*
+ * cow_copy()
+ * ----------
+ * Write fault on a copy-on-write page: the page gets a private copy of its
+ * frame, or just loses PTE_COW if no other space maps the frame any more.
+ * Sharing only grows under the PDE lock, which the caller holds.
+ *
+ * Return: 0 if the page is writable now; -1 if no frame is left.
+ */
+static int cow_copy(pte_t* entry, vaddr_t va)
+{
+    pte_t old_entry = *entry;
+    if((old_entry & (IN_USE | PTE_COW)) != (IN_USE | PTE_COW)) return 0;
+
+    uint32_t frame = (old_entry & ~OFFMASK) >> OFFSET_BITS;
+    if(__atomic_load_n(&frame_shares[frame], __ATOMIC_ACQUIRE) == 0) {
+      __atomic_fetch_and(entry, ~PTE_COW, __ATOMIC_RELEASE);
+      return 0;
+    }
+
+    char* copy = alloc_frame();
+    if(copy == NULL) return -1;
+    memcpy(copy, (char*)p_buff + (size_t)frame * PGSIZE, PGSIZE);
+
+    uint32_t pa_offset = copy - (char*)p_buff;
+    frame_owner[pa_offset >> OFFSET_BITS] = (va & ~OFFMASK) | cur_space->asid;
+    __atomic_store_n(entry, pa_offset | IN_USE, __ATOMIC_SEQ_CST);
+
+    // readers that pinned the old frame keep it alive until they are done
+    if(frame_retire(frame)) free_frame((char*)p_buff + (size_t)frame * PGSIZE);
+    return 0;
+}
+
+/*
+ * cow_break()
+ * -----------
+ * cow_copy() for the page at va of the current space, under its PDE lock.
+ *
+ * Return: 0 if the page is writable now; -1 if no frame is left.
+ */
+static int cow_break(vaddr_t va)
+{
+    pde_t* pgdir = pgdir_of(cur_space->pgdir, va, false);
+    uint32_t pgdir_idx = PDX(va);
+    int ret = 0;
+    if(pgdir == NULL) return 0;
+
+    pthread_mutex_lock(&pde_locks[pgdir_idx]);
+    pde_t pgdir_entry = pgdir[pgdir_idx];
+    if((pgdir_entry & IN_USE) && !(pgdir_entry & PDE_LARGE)) {
+      pte_t* pgtbl = (pte_t*)((char*)p_buff + (pgdir_entry & ~OFFMASK));
+      ret = cow_copy(&pgtbl[PTX(va)], va);
+    }
+    pthread_mutex_unlock(&pde_locks[pgdir_idx]);
+
+    return ret;
+}
+
+/*
+ * drop_unbacked()
+ * ---------------
+ * Releases a page that has no frame: a reservation that was never touched,
+ * or a page in swap, whose slot is freed. A reserved PDE is dropped whole
+ * when va starts it and at least PGS_PER_SUPERPAGE pages are being released;
+ * otherwise it is expanded into a page table first.
+ *
+ * Return: number of pages released starting at va (0 if there was none).
+ */
+static uint32_t drop_unbacked(vaddr_t va, uint32_t max_pages)
+{
+    pde_t* pgdir = pgdir_of(cur_space->pgdir, va, false);
+    uint32_t pgdir_idx = PDX(va);
+    uint32_t released = 0;
+    if(pgdir == NULL) return 0;
+
+    pthread_mutex_lock(&pde_locks[pgdir_idx]);
+    pde_t pgdir_entry = pgdir[pgdir_idx];
+    if(pgdir_entry == PTE_RESERVED && PTX(va) == 0 && max_pages >= PGS_PER_SUPERPAGE) {
+      __atomic_store_n(&pgdir[pgdir_idx], 0, __ATOMIC_RELEASE);
+      released = PGS_PER_SUPERPAGE;
+    } else if(pgdir_entry == PTE_RESERVED ||
+              ((pgdir_entry & IN_USE) && !(pgdir_entry & PDE_LARGE))) {
+      pte_t* pgtbl = pgtbl_upsert(pgdir, pgdir_idx);
+      pte_t entry = (pgtbl != NULL) ? pgtbl[PTX(va)] : 0;
+      if(entry == PTE_RESERVED || (entry & PTE_SWAPPED)) {
+        __atomic_store_n(&pgtbl[PTX(va)], 0, __ATOMIC_RELEASE);
+        pgtbl_count(pgtbl, -1);
+        if(entry & PTE_SWAPPED) swap_slot_free((entry & ~OFFMASK) >> OFFSET_BITS);
+        released = 1;
+      }
+    }
+    pthread_mutex_unlock(&pde_locks[pgdir_idx]);
+
+    return released;
+}
+
+/*
+ * reserve_range()
+ * ---------------
+ * Reserves num_pages consecutive virtual pages for demand paging without
+ * giving them frames. A whole, empty PDE span is reserved in its PDE alone,
+ * so reserving a large aligned block costs one store per span; other pages
+ * get PTE_RESERVED entries. On failure the reservation is rolled back.
+ *
+ * Return: 0 on success; -1 if a page is already in use or no frame is left
+ *         for a page table.
+ */
+static int reserve_range(vaddr_t va_base, uint32_t num_pages)
+{
+    pde_t* root = cur_space->pgdir;
+    uint32_t reserved = 0;
+
+    while(reserved < num_pages) {
+      vaddr_t v_addr = va_base + reserved * PGSIZE;
+      uint32_t pgdir_idx = PDX(v_addr);
+      uint32_t first = PTX(v_addr);
+      uint32_t n = PGS_PER_SUPERPAGE - first;
+      if(n > num_pages - reserved) n = num_pages - reserved;
+
+      pde_t* pgdir = pgdir_of(root, v_addr, true);
+      if(pgdir == NULL) break;
+
+      pthread_mutex_lock(&pde_locks[pgdir_idx]);
+      bool ok = true;
+      if(n == PGS_PER_SUPERPAGE && pgdir[pgdir_idx] == 0) {
+        __atomic_store_n(&pgdir[pgdir_idx], PTE_RESERVED, __ATOMIC_RELEASE);
+      } else {
+        pte_t* pgtbl = (pgdir[pgdir_idx] & PDE_LARGE) ? NULL : pgtbl_upsert(pgdir, pgdir_idx);
+        for(uint32_t i = 0; ok && i < n; i++) ok = (pgtbl != NULL && pgtbl[first + i] == 0);
+        for(uint32_t i = 0; ok && i < n; i++) pgtbl[first + i] = PTE_RESERVED;
+        if(ok) pgtbl_count(pgtbl, n);
+      }
+      pthread_mutex_unlock(&pde_locks[pgdir_idx]);
+
+      if(!ok) break;
+      reserved += n;
+    }
+
+    if(reserved < num_pages) {
+      for(uint32_t done = 0; done < reserved; ) {
+        uint32_t n = drop_unbacked(va_base + done * PGSIZE, reserved - done);
+        done += n ? n : 1;
+      }
+      return -1;
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Allocation
+// -----------------------------------------------------------------------------
+
+/*
+ * word_max_free_run()
+ * -------------------
+ * Length of the longest run of clear (free) bits in a bitmap word.
+ */
+static inline uint32_t word_max_free_run(uint64_t word)
+{
+    if(word == 0) return 64;
+
+    uint32_t best = 0;
+    uint64_t free_bits = ~word;
+    while(free_bits) {
+      free_bits >>= __builtin_ctzll(free_bits);
+      uint32_t run = __builtin_ctzll(~free_bits);
+      if(run > best) best = run;
+      free_bits >>= run;
+    }
+    return best;
+}
+
+/*
+ * free_run_starts()
+ * -----------------
+ * Returns a mask with bit i set iff bits i..i+n-1 of word are all clear,
+ * for 1 <= n <= 64. Runs are combined by doubling shifts, so this costs
+ * O(log n) word operations.
+ */
+static inline uint64_t free_run_starts(uint64_t word, uint32_t n)
+{
+    uint64_t starts = ~word;
+    uint32_t have = 1;
+    while(have < n && starts) {
+      uint32_t shift = (have < n - have) ? have : n - have;
+      starts &= starts >> shift;
+      have += shift;
+    }
+    return starts;
+}
+
+// number of pages spanned by an extent tree node
+static inline uint32_t v_tree_span(uint32_t node)
+{
+    return 64u << (__builtin_clz(node) - __builtin_clz(V_BMAP_WORDS));
+}
+
+// reads and writes a node value of the extent tree, stored as its shortfall
+// from the node's span
+static inline uint32_t vt_get(const uint32_t* field, uint32_t node)
+{
+    return v_tree_span(node) - field[node];
+}
+
+static inline void vt_set(uint32_t* field, uint32_t node, uint32_t pages)
+{
+    field[node] = v_tree_span(node) - pages;
+}
+
+static inline void v_tree_leaf(uint32_t w)
+{
+    struct extent_tree* vt = cur_space->v_tree;
+    uint64_t word = cur_space->v_bmap[w];
+    uint32_t node = V_BMAP_WORDS + w;
+
+    vt_set(vt->prefix, node, word ? __builtin_ctzll(word) : 64);
+    vt_set(vt->suffix, node, word ? __builtin_clzll(word) : 64);
+    vt_set(vt->best, node, word_max_free_run(word));
+}
+
+static inline void v_tree_pull(uint32_t node)
+{
+    struct extent_tree* vt = cur_space->v_tree;
+    uint32_t l = 2 * node, r = l + 1;
+    uint32_t half = v_tree_span(l);
+
+    uint32_t l_prefix = vt_get(vt->prefix, l), r_prefix = vt_get(vt->prefix, r);
+    uint32_t l_suffix = vt_get(vt->suffix, l), r_suffix = vt_get(vt->suffix, r);
+
+    vt_set(vt->prefix, node, (l_prefix == half) ? half + r_prefix : l_prefix);
+    vt_set(vt->suffix, node, (r_suffix == half) ? half + l_suffix : r_suffix);
+
+    uint32_t best = l_suffix + r_prefix;
+    if(vt_get(vt->best, l) > best) best = vt_get(vt->best, l);
+    if(vt_get(vt->best, r) > best) best = vt_get(vt->best, r);
+    vt_set(vt->best, node, best);
+}
+
+/*
+ * v_tree_build()
+ * --------------
+ * Rebuilds the current space's extent tree from its v_bmap. Not needed for
+ * a new space, whose zeroed tree already describes its empty v_bmap. Caller
+ * holds lock.
+ */
+static void v_tree_build(void)
+{
+    uint32_t used = 0;
+    for(uint32_t w = 0; w < V_BMAP_WORDS; w++) {
+      v_tree_leaf(w);
+      used += __builtin_popcountll(cur_space->v_bmap[w]);
+    }
+    for(uint32_t node = V_BMAP_WORDS - 1; node >= 1; node--) v_tree_pull(node);
+    __atomic_store_n(&cur_space->vpages_used, used, __ATOMIC_RELAXED);
+}
+
+/*
+ * v_bmap_mark()
+ * -------------
+ * Marks a run of virtual pages used or free, a word at a time, then refreshes
+ * the extent tree nodes covering the touched words and the space's count of
+ * used pages. Caller holds lock.
+ */
+static void v_bmap_mark(uint32_t start, uint32_t num_pages, bool used)
+{
+    if(num_pages == 0) return;
+
+    uint32_t first_w = start / 64, last_w = (start + num_pages - 1) / 64;
+
+    // count the touched words before and after, as callers may pass pages
+    // that are already in the requested state
+    uint32_t before = 0, after = 0;
+    for(uint32_t w = first_w; w <= last_w; w++) {
+      before += __builtin_popcountll(cur_space->v_bmap[w]);
+    }
+    bmap_fill(cur_space->v_bmap, start, num_pages, used);
+    for(uint32_t w = first_w; w <= last_w; w++) {
+      v_tree_leaf(w);
+      after += __builtin_popcountll(cur_space->v_bmap[w]);
+    }
+    __atomic_store_n(&cur_space->vpages_used,
+                     cur_space->vpages_used + after - before, __ATOMIC_RELAXED);
+
+    uint32_t lo = V_BMAP_WORDS + first_w, hi = V_BMAP_WORDS + last_w;
+    while(lo > 1) {
+      lo /= 2;
+      hi /= 2;
+      for(uint32_t node = lo; node <= hi; node++) v_tree_pull(node);
+    }
+}
+
+/*
+ * v_tree_find()
+ * -------------
+ * Finds the lowest virtual page starting a run of num_pages free pages by
+ * descending the extent tree. Caller holds lock.
+ *
+ * Return: first page index of the run; -1 if no such run exists.
+ */
+static int64_t v_tree_find(uint32_t num_pages)
+{
+    struct extent_tree* vt = cur_space->v_tree;
+    if(vt_get(vt->best, 1) < num_pages) return -1;
+
+    uint32_t node = 1;
+    while(node < V_BMAP_WORDS) {
+      uint32_t l = 2 * node, r = l + 1;
+      uint32_t l_suffix = vt_get(vt->suffix, l);
+      if(vt_get(vt->best, l) >= num_pages) {
+        node = l;
+      } else if(l_suffix + vt_get(vt->prefix, r) >= num_pages) {
+        // the run straddles both children
+        uint32_t r_first = (r << (__builtin_clz(r) - __builtin_clz(V_BMAP_WORDS)))
+                           - V_BMAP_WORDS;
+        return (int64_t)r_first * 64 - l_suffix;
+      } else {
+        node = r;
+      }
+    }
+
+    // the run lies inside one word, so num_pages <= 64
+    uint32_t w = node - V_BMAP_WORDS;
+    uint64_t starts = free_run_starts(cur_space->v_bmap[w], num_pages);
+    return (int64_t)w * 64 + __builtin_ctzll(starts);
+}
+
+/*
+ * get_next_avail()
+ * ----------------
+ * Finds and returns the base virtual address of the next available
+ * block of contiguous free pages.
+ *
+ * Return:
+ *   Pointer to the base virtual address if available.
+ *   NULL if there are no sufficient free pages.
+ */
+void *get_next_avail(int num_pages)
+{
+    if(num_pages <= 0) return NULL;
+
+    pthread_mutex_lock(&lock);
+    int64_t chunk_start = v_tree_find(num_pages);
+    pthread_mutex_unlock(&lock);
+
+    if(chunk_start < 0) return NULL;
+
+    // return void* to the corresponding vpage addr
+    vaddr_t vpage_byte_offset = (vaddr_t)chunk_start << OFFSET_BITS;
+    return U2VA(vpage_byte_offset);
+}
+
+/*
+ * get_superpage_avail()
+ * ---------------------
+ * Like get_next_avail(), but the block starts on a SUPERPAGE_SIZE boundary
+ * so that its whole PDE spans can be mapped as superpages.
+ *
+ * Return: pointer to the base virtual address; NULL if no aligned block fits.
+ */
+static void *get_superpage_avail(uint32_t num_pages)
+{
+    if(num_pages > NUM_VPAGES - PGS_PER_SUPERPAGE) return NULL;
+
+    pthread_mutex_lock(&lock);
+    int64_t chunk_start = v_tree_find(num_pages + PGS_PER_SUPERPAGE - 1);
+    pthread_mutex_unlock(&lock);
+
+    if(chunk_start < 0) return NULL;
+
+    uint32_t aligned = ((uint32_t)chunk_start + PGS_PER_SUPERPAGE - 1)
+                       & ~(PGS_PER_SUPERPAGE - 1);
+    return U2VA((vaddr_t)aligned << OFFSET_BITS);
+}
+
+/*
+ * vm_alloc()
+ * ----------
+ * Shared body of n_malloc() and n_malloc_lazy(): finds a virtual block,
+ * then maps it eagerly or only reserves it for demand paging.
+ *
+ * Return: base virtual address; NULL on failure (nothing is left behind).
+ */
+static void *vm_alloc(unsigned int num_bytes, bool lazy)
+{
+    if(num_bytes == 0) return NULL;
+    
+    if(cur_space->readonly) return NULL;
+
+    pthread_mutex_lock(&multi_op_lock);
+    if(root_space.pgdir == NULL) set_physical_mem();
+
+    uint32_t num_pages = (num_bytes + PGSIZE - 1) >> OFFSET_BITS;
+    void* va_base_raw = NULL;
+    if(num_pages >= PGS_PER_SUPERPAGE) va_base_raw = get_superpage_avail(num_pages);
+    if(va_base_raw == NULL) va_base_raw = get_next_avail(num_pages);
+
+    if(va_base_raw == NULL) {
+      pthread_mutex_unlock(&multi_op_lock);
+      return NULL;
+    }
+    vaddr_t va_base = VA2U(va_base_raw);
+
+    // map_range() and reserve_range() roll back on failure, so nothing is
+    // left to undo here
+    int ret = lazy ? reserve_range(va_base, num_pages) : map_range(va_base, num_pages);
+    if(ret == -1) {
+      pthread_mutex_unlock(&multi_op_lock);
+      return NULL;
     }
 
-    pthread_mutex_unlock(&multi_op_lock);
-    return U2VA(va_base);
+    pthread_mutex_lock(&lock);
+    v_bmap_mark(va_base >> OFFSET_BITS, num_pages, true);
+    pthread_mutex_unlock(&lock);
+
+    pthread_mutex_unlock(&multi_op_lock);
+    return U2VA(va_base);
+}
+
+/*
+ * n_malloc()
+ * -----------
+ * Allocates a given number of bytes in virtual memory.
+ * Initializes physical memory and page directories if not already done.
+ *
+ * Return:
+ *   Pointer to the starting virtual address of allocated memory (success).
+ *   NULL if allocation fails.
+ */
+
+void *n_malloc(unsigned int num_bytes)
+{
+    return vm_alloc(num_bytes, false);
+}
+
+/*
+ * n_malloc_lazy()
+ * ---------------
+ * Allocates a given number of bytes in virtual memory without backing it:
+ * pages only get a (zeroed) frame the first time put_data()/get_data() or
+ * n_pin() touches them.
+ *
+ * Return:
+ *   Pointer to the starting virtual address of allocated memory (success).
+ *   NULL if allocation fails.
+ */
+void *n_malloc_lazy(unsigned int num_bytes)
+{
+    return vm_alloc(num_bytes, true);
 }
 
 /*
@@ -398,34 +2805,432 @@ void *n_malloc(unsigned int num_bytes)
  */
 void n_free(void *va, int size)
 {
+  pde_t* root = cur_space->pgdir;
   if(va == NULL || size <= 0) return;
 
-  vaddr32_t va_base = VA2U(va);
-  uint32_t num_pages = (size + PGSIZE - 1) / PGSIZE;
+  // only the n_malloc() range has v_bmap pages to give back
+  vaddr_t va_base = VA2U(va);
+  if((uint64_t)va_base + (uint32_t)size > MAX_MEMSIZE) return;
+  uint32_t num_pages = (size + PGSIZE - 1) >> OFFSET_BITS;
+  uint32_t tables[1 << MAX_PDX_BITS];
+  uint32_t done = 0, reclaimed = 0;
 
-  for(uint32_t i = 0; i < num_pages; i++) {
-    vaddr32_t va = va_base + (i * PGSIZE);
-    pte_t* pte = translate(pgdir, U2VA(va));
-    
-    // cannot free unallocated frame
-    if(pte == NULL || ((*pte & IN_USE) == 0)) continue; 
-    
-    // clear corresponding v_page bit
-    uint32_t v_page_bit_idx = va / PGSIZE;
-    pthread_mutex_lock(&lock);
-    clear_bit(v_bmap, v_page_bit_idx);
+  // one page table span at a time: every entry of the span is cleared under
+  // a single hold of its PDE lock, without going through the TLB
+  while(done < num_pages) {
+    vaddr_t v_addr = va_base + done * PGSIZE;
+    uint32_t pgdir_idx = PDX(v_addr);
+    uint32_t first = PTX(v_addr);
+    uint32_t n = PGS_PER_SUPERPAGE - first;
+    if(n > num_pages - done) n = num_pages - done;
+    done += n;
 
-    // clear corresponding p_frame bit
-    paddr32_t pa = (*pte & ~OFFMASK);
-    uint32_t p_frame_bit_idx = (pa - (paddr32_t)(uintptr_t)p_buff) / PGSIZE;
-    clear_bit(p_bmap, p_frame_bit_idx);
-    pthread_mutex_unlock(&lock);
-    // clear corresponding pgtbl entry
+    pde_t* pgdir = pgdir_of(root, v_addr, false);
+    if(pgdir == NULL) continue;
+
+    if(__atomic_load_n(&pgdir[pgdir_idx], __ATOMIC_ACQUIRE) & PDE_LARGE) {
+      // a superpage wholly inside the range goes back in one piece
+      if(n == PGS_PER_SUPERPAGE) {
+        if(unmap_superpage(pgdir, v_addr)) {
+          pthread_mutex_lock(&lock);
+          v_bmap_mark(v_addr >> OFFSET_BITS, n, false);
+          pthread_mutex_unlock(&lock);
+        }
+        continue;
+      }
+
+      // otherwise break it into pages and free just these
+      if(split_superpage(pgdir, v_addr) == -1) continue;
+    }
+
+    // a PDE reserved whole by n_malloc_lazy() is dropped whole, or expanded
+    // into a page table if only part of it goes
+    uint64_t gone[MAX_PGS_PER_SUPERPAGE / 64] = {0};
+
+    pthread_mutex_lock(&pde_locks[pgdir_idx]);
+    pde_t pgdir_entry = pgdir[pgdir_idx];
+    pte_t* pgtbl = NULL;
+    if(pgdir_entry == PTE_RESERVED && n == PGS_PER_SUPERPAGE) {
+      __atomic_store_n(&pgdir[pgdir_idx], 0, __ATOMIC_RELEASE);
+      bmap_fill(gone, 0, n, true);
+    } else if(pgdir_entry == PTE_RESERVED ||
+              ((pgdir_entry & IN_USE) && !(pgdir_entry & PDE_LARGE))) {
+      pgtbl = pgtbl_upsert(pgdir, pgdir_idx);
+    }
+
+    // the exchange under the PDE lock makes sure only one of several racing
+    // n_free() calls releases a frame. a page reserved but never touched, or
+    // one in swap, has no frame; only its entry and swap slot go.
+    for(uint32_t i = 0; pgtbl != NULL && i < n; i++) {
+      pte_t old_pte = __atomic_exchange_n(&pgtbl[first + i], 0, __ATOMIC_SEQ_CST);
+      if(old_pte == 0) continue;
+      gone[i / 64] |= 1ULL << (i % 64);
+      pgtbl_count(pgtbl, -1);
+
+      // hand the frame back (PTEs hold p_buff offsets). a pinned frame is
+      // handed back by its last n_unpin() instead.
+      uint32_t frame = (old_pte & ~OFFMASK) >> OFFSET_BITS;
+      if(old_pte & IN_USE) {
+        if(frame_retire(frame)) free_frame((char*)p_buff + (size_t)frame * PGSIZE);
+      } else if(old_pte & PTE_SWAPPED) {
+        swap_slot_free(frame);
+      }
+    }
+    if(pgtbl != NULL) {
+      int64_t table = pgtbl_reclaim(pgdir, pgdir_idx);
+      if(table >= 0) tables[reclaimed++] = table;
+    }
+    pthread_mutex_unlock(&pde_locks[pgdir_idx]);
 
-    pthread_mutex_lock(&pg_tbl_lock);
-    *pte = 0;
-    pthread_mutex_unlock(&pg_tbl_lock);
+    // clear the v_page bits of the pages released, run by run
+    pthread_mutex_lock(&lock);
+    for(uint32_t i = 0; i < n; ) {
+      if(!(gone[i / 64] & (1ULL << (i % 64)))) { i++; continue; }
+      uint32_t run = i;
+      while(run < n && (gone[run / 64] & (1ULL << (run % 64)))) run++;
+      v_bmap_mark((v_addr >> OFFSET_BITS) + i, run - i, false);
+      i = run;
+    }
+    pthread_mutex_unlock(&lock);
   }
+
+  // no thread may keep using a translation of a freed page, and no TLB entry
+  // or walk in flight may point into a page table once its frame is reused
+  tlb_invalidate_range(va_base, num_pages);
+  if(reclaimed > 0) pgtbl_retire(tables, reclaimed);
+}
+
+// -----------------------------------------------------------------------------
+// Small Objects
+// -----------------------------------------------------------------------------
+
+/*
+ * slab_class()
+ * ------------
+ * Size class of a request: 0 for up to SLAB_MIN_SIZE bytes, then one class
+ * per power of two.
+ */
+static inline uint32_t slab_class(uint32_t num_bytes)
+{
+    if(num_bytes <= SLAB_MIN_SIZE) return 0;
+    return 32 - __builtin_clz(num_bytes - 1) - SLAB_MIN_SHIFT;
+}
+
+static inline uint32_t slab_objs(uint32_t cls)
+{
+    return SLAB_SIZE >> (cls + SLAB_MIN_SHIFT);
+}
+
+/*
+ * slab_lookup()
+ * -------------
+ * Finds the slab holding a virtual address of the current space.
+ *
+ * Return: the slab; NULL if va is not in one.
+ */
+static struct slab* slab_lookup(struct slab_heap* heap, vaddr_t va)
+{
+    // bound the directory index itself: with 32-bit addresses every va is
+    // below MAX_MEMSIZE, but not every layout fills the directory
+    if((va >> PDXSHIFT) >= SLAB_DIR_ENTRIES) return NULL;
+    struct slab** leaf = __atomic_load_n(&heap->dir[va >> PDXSHIFT], __ATOMIC_ACQUIRE);
+    if(leaf == NULL) return NULL;
+    return __atomic_load_n(&leaf[PTX(va)], __ATOMIC_ACQUIRE);
+}
+
+/*
+ * slab_dir_set()
+ * --------------
+ * Points the directory entries of a slab's pages at slab (NULL to clear
+ * them), creating leaves as needed.
+ *
+ * Return: 0 on success, -1 if out of memory.
+ */
+static int slab_dir_set(struct slab_heap* heap, vaddr_t va, struct slab* slab)
+{
+    for(uint32_t i = 0; i < SLAB_PAGES; i++, va += PGSIZE) {
+      struct slab** leaf = __atomic_load_n(&heap->dir[va >> PDXSHIFT], __ATOMIC_ACQUIRE);
+      if(leaf == NULL) {
+        struct slab** fresh = calloc(1u << PTX_BITS, sizeof(struct slab*));
+        if(fresh == NULL) return -1;
+        if(__atomic_compare_exchange_n(&heap->dir[va >> PDXSHIFT], &leaf, fresh, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+          leaf = fresh;
+        } else {
+          free(fresh);
+        }
+      }
+      __atomic_store_n(&leaf[PTX(va)], slab, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+static void slab_link(struct slab_heap* heap, struct slab* slab)
+{
+    slab->next = heap->partial[slab->cls];
+    slab->pprev = &heap->partial[slab->cls];
+    if(slab->next != NULL) slab->next->pprev = &slab->next;
+    heap->partial[slab->cls] = slab;
+}
+
+static void slab_unlink(struct slab* slab)
+{
+    *slab->pprev = slab->next;
+    if(slab->next != NULL) slab->next->pprev = slab->pprev;
+    slab->next = NULL;
+    slab->pprev = NULL;
+}
+
+/*
+ * slab_create()
+ * -------------
+ * Carves a new slab of class cls out of the page allocator. Its pages are
+ * reserved lazily, so they take frames only as their objects get touched.
+ *
+ * Return: the slab, all of its objects free; NULL on failure.
+ */
+static struct slab* slab_create(struct slab_heap* heap, uint32_t cls)
+{
+    struct slab* slab = calloc(1, sizeof(struct slab));
+    void* va = (slab != NULL) ? vm_alloc(SLAB_SIZE, true) : NULL;
+    if(va == NULL) {
+      free(slab);
+      return NULL;
+    }
+
+    slab->va = VA2U(va);
+    slab->cls = cls;
+    slab->nfree = slab_objs(cls);
+    bmap_fill(slab->free_bits, 0, slab->nfree, true);
+
+    if(slab_dir_set(heap, slab->va, slab) == -1) {
+      slab_dir_set(heap, slab->va, NULL);
+      n_free(va, SLAB_SIZE);
+      free(slab);
+      return NULL;
+    }
+    return slab;
+}
+
+/*
+ * slab_destroy()
+ * --------------
+ * Hands an unlinked slab with no live objects back to the page allocator.
+ * Its directory entries are cleared first, since the virtual pages may be
+ * reused as soon as n_free() returns.
+ */
+static void slab_destroy(struct slab_heap* heap, struct slab* slab)
+{
+    slab_dir_set(heap, slab->va, NULL);
+    n_free(U2VA(slab->va), SLAB_SIZE);
+    free(slab);
+}
+
+/*
+ * slab_refill()
+ * -------------
+ * Takes up to n free objects of class cls, lowest addresses of the first
+ * partial slab first, and creates slabs while the class runs dry.
+ *
+ * Return: number of objects stored in out (0 if out of memory).
+ */
+static uint32_t slab_refill(struct slab_heap* heap, uint32_t cls, vaddr_t* out, uint32_t n)
+{
+    uint32_t size = SLAB_MIN_SIZE << cls;
+    uint32_t got = 0;
+
+    pthread_mutex_lock(&heap->locks[cls]);
+    while(got < n) {
+      struct slab* slab = heap->partial[cls];
+      if(slab == NULL) {
+        // the page allocator takes its own locks; don't hold the class
+        pthread_mutex_unlock(&heap->locks[cls]);
+        slab = slab_create(heap, cls);
+        pthread_mutex_lock(&heap->locks[cls]);
+        if(slab == NULL) break;
+        slab_link(heap, slab);
+        continue;
+      }
+
+      for(uint32_t w = 0; got < n && slab->nfree > 0; w++) {
+        uint64_t bits = slab->free_bits[w];
+        while(bits != 0 && got < n) {
+          uint32_t idx = w * 64 + __builtin_ctzll(bits);
+          bits &= bits - 1;
+          out[got++] = slab->va + idx * size;
+          slab->nfree--;
+        }
+        slab->free_bits[w] = bits;
+      }
+      if(slab->nfree == 0) slab_unlink(slab);
+    }
+    pthread_mutex_unlock(&heap->locks[cls]);
+
+    return got;
+}
+
+/*
+ * slab_drain()
+ * ------------
+ * Returns n objects of class cls to their slabs. A slab whose objects are
+ * all free again is released, unless it is the last partial slab of its
+ * class, which is kept to absorb alloc/free churn.
+ */
+static void slab_drain(struct slab_heap* heap, uint32_t cls, const vaddr_t* objs, uint32_t n)
+{
+    uint32_t shift = cls + SLAB_MIN_SHIFT;
+    struct slab* empty[OBJ_MAG_SIZE];
+    uint32_t nempty = 0;
+
+    pthread_mutex_lock(&heap->locks[cls]);
+    for(uint32_t i = 0; i < n; i++) {
+      struct slab* slab = slab_lookup(heap, objs[i]);
+      if(slab == NULL) continue;
+
+      uint32_t idx = (objs[i] - slab->va) >> shift;
+      slab->free_bits[idx / 64] |= 1ULL << (idx % 64);
+      if(slab->nfree++ == 0) slab_link(heap, slab);
+
+      if(slab->nfree == slab_objs(cls) &&
+         (heap->partial[cls] != slab || slab->next != NULL)) {
+        slab_unlink(slab);
+        empty[nempty++] = slab;
+      }
+    }
+    pthread_mutex_unlock(&heap->locks[cls]);
+
+    for(uint32_t i = 0; i < nempty; i++) slab_destroy(heap, empty[i]);
+}
+
+/*
+ * obj_mags_flush()
+ * ----------------
+ * Hands every object the calling thread caches back to the slabs of its
+ * current space.
+ */
+static void obj_mags_flush(void)
+{
+    struct slab_heap* heap = cur_space->heap;
+    for(uint32_t cls = 0; cls < SLAB_CLASSES; cls++) {
+      if(obj_mags[cls].count == 0) continue;
+      slab_drain(heap, cls, obj_mags[cls].objs, obj_mags[cls].count);
+      obj_mags[cls].count = 0;
+    }
+}
+
+/*
+ * slab_heap_free()
+ * ----------------
+ * Frees the bookkeeping of a space's small-object heap. The pages of its
+ * slabs are n_free()d too if release_pages is set (the heap must belong to
+ * the current space then); otherwise they go with the space's page tables.
+ */
+static void slab_heap_free(struct slab_heap* heap, bool release_pages)
+{
+    if(heap == NULL) return;
+
+    for(uint32_t spn = 0; spn < (NUM_VPAGES >> PTX_BITS); spn++) {
+      struct slab** leaf = heap->dir[spn];
+      if(leaf == NULL) continue;
+
+      // a slab is listed under each of its pages; free it at its first
+      for(uint32_t i = 0; i < (1u << PTX_BITS); i++) {
+        vaddr_t va = ((vaddr_t)spn << PDXSHIFT) + i * PGSIZE;
+        if(leaf[i] == NULL || leaf[i]->va != va) continue;
+        if(release_pages) n_free(U2VA(va), SLAB_SIZE);
+        free(leaf[i]);
+      }
+      free(leaf);
+    }
+    for(uint32_t cls = 0; cls < SLAB_CLASSES; cls++) {
+      pthread_mutex_destroy(&heap->locks[cls]);
+    }
+    free(heap);
+}
+
+/*
+ * n_malloc_small()
+ * ----------------
+ * Allocates a small object from the calling thread's cache for its size
+ * class, refilling the cache from the class's slabs when it runs dry.
+ * Only refills, and the slab allocations behind them, take locks.
+ *
+ * Return:
+ *   Virtual address of the object (success).
+ *   NULL if num_bytes is 0 or over SLAB_MAX_SIZE, or memory is exhausted.
+ */
+void *n_malloc_small(unsigned int num_bytes)
+{
+    if(num_bytes == 0 || num_bytes > SLAB_MAX_SIZE) return NULL;
+    if(cur_space->readonly) return NULL;
+
+    struct slab_heap* heap = __atomic_load_n(&cur_space->heap, __ATOMIC_ACQUIRE);
+    if(heap == NULL) {
+      struct slab_heap* fresh = calloc(1, sizeof(struct slab_heap));
+      if(fresh == NULL) return NULL;
+      for(uint32_t cls = 0; cls < SLAB_CLASSES; cls++) {
+        pthread_mutex_init(&fresh->locks[cls], NULL);
+      }
+      if(__atomic_compare_exchange_n(&cur_space->heap, &heap, fresh, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        heap = fresh;
+      } else {
+        slab_heap_free(fresh, false);
+      }
+    }
+
+    uint32_t cls = slab_class(num_bytes);
+    struct obj_mag* mag = &obj_mags[cls];
+    if(mag->count == 0) {
+      vm_thread_register();
+      mag->count = slab_refill(heap, cls, mag->objs, OBJ_MAG_BATCH);
+      if(mag->count == 0) return NULL;
+    }
+    return U2VA(mag->objs[--mag->count]);
+}
+
+/*
+ * n_free_small()
+ * --------------
+ * Frees an object from n_malloc_small(). Its size class is found through
+ * the slab directory, so the caller does not pass a size. The object goes
+ * to the calling thread's cache; a full cache hands its oldest
+ * OBJ_MAG_BATCH objects back to their slabs. An address that is not the
+ * start of an object in a slab, or an object that is already free in its
+ * slab, is ignored.
+ *
+ * Return value: None.
+ */
+void n_free_small(void *va)
+{
+    struct slab_heap* heap = __atomic_load_n(&cur_space->heap, __ATOMIC_ACQUIRE);
+    if(va == NULL || heap == NULL) return;
+
+    struct slab* slab = slab_lookup(heap, VA2U(va));
+    if(slab == NULL) return;
+
+    // only the start of an object goes back; anything else would later be
+    // handed out overlapping its neighbours
+    if((VA2U(va) - slab->va) % (SLAB_MIN_SIZE << slab->cls) != 0) return;
+
+    // a double free would hand the object out twice. the object's own bit
+    // is only set by its drain, so it can be read without the class lock.
+    // an object still sitting in a thread's cache is not caught: scanning
+    // the cache on every free would double its cost
+    uint32_t idx = (VA2U(va) - slab->va) >> (slab->cls + SLAB_MIN_SHIFT);
+    if(__atomic_load_n(&slab->free_bits[idx / 64], __ATOMIC_RELAXED) & (1ULL << (idx % 64))) {
+      return;
+    }
+
+    struct obj_mag* mag = &obj_mags[slab->cls];
+    vm_thread_register();
+    if(mag->count == OBJ_MAG_SIZE) {
+      slab_drain(heap, slab->cls, mag->objs, OBJ_MAG_BATCH);
+      memmove(mag->objs, mag->objs + OBJ_MAG_BATCH,
+              (OBJ_MAG_SIZE - OBJ_MAG_BATCH) * sizeof(vaddr_t));
+      mag->count -= OBJ_MAG_BATCH;
+    }
+    mag->objs[mag->count++] = VA2U(va);
 }
 
 // -----------------------------------------------------------------------------
@@ -443,7 +3248,7 @@ void n_free(void *va, int size)
  *  -1  -> Failure (e.g., translation failure)
  */
 int put_data(void *va, void *val, int size) {
-  return copy_data(va, val, size, 1);
+  return copy_data(va, val, size, 1, false);
 }
 
 /*
@@ -455,7 +3260,324 @@ int put_data(void *va, void *val, int size) {
  * Return value: None.
  */
 void get_data(void *va, void *val, int size) {
-  copy_data(va, val, size, 0);
+  copy_data(va, val, size, 0, false);
+}
+
+/*
+ * put_data_locked()
+ * -----------------
+ * Same as put_data(), but every page-sized chunk is written while holding
+ * the stripe lock of its frame.
+ *
+ * Return:
+ *   0  -> Success (data written successfully)
+ *  -1  -> Failure (e.g., translation failure)
+ */
+int put_data_locked(void *va, void *val, int size) {
+  return copy_data(va, val, size, 1, true);
+}
+
+/*
+ * get_data_locked()
+ * -----------------
+ * Same as get_data(), but every page-sized chunk is read while holding the
+ * stripe lock of its frame.
+ *
+ * Return value: None.
+ */
+void get_data_locked(void *va, void *val, int size) {
+  copy_data(va, val, size, 0, true);
+}
+
+/*
+ * put_datav()
+ * -----------
+ * Scatters cnt host buffers into simulated memory, translating each page
+ * the batch touches once rather than once per element.
+ *
+ * Return:
+ *   0  -> Success (every element written)
+ *  -1  -> Failure (bad descriptor or unbackable page; the elements of
+ *         pages visited before it are written)
+ */
+int put_datav(const struct vm_iovec *iov, int cnt) {
+  return copy_datav(iov, cnt, 1);
+}
+
+/*
+ * get_datav()
+ * -----------
+ * Gathers cnt pieces of simulated memory into host buffers, translating
+ * each page the batch touches once rather than once per element.
+ *
+ * Return:
+ *   0  -> Success (every element read)
+ *  -1  -> Failure (bad descriptor or unbackable page)
+ */
+int get_datav(const struct vm_iovec *iov, int cnt) {
+  return copy_datav(iov, cnt, 0);
+}
+
+// -----------------------------------------------------------------------------
+// Pinning
+// -----------------------------------------------------------------------------
+
+/*
+ * span_push()
+ * -----------
+ * Appends len bytes at host address ptr to a span, growing the last segment
+ * when the bytes are physically contiguous with it.
+ *
+ * Return: 0 on success, -1 if the segment array could not grow.
+ */
+static int span_push(struct vm_span* span, uint32_t* cap, char* ptr, uint32_t len)
+{
+    if(span->nsegs > 0) {
+      struct vm_seg* last = &span->segs[span->nsegs - 1];
+      if((char*)last->ptr + last->len == ptr) {
+        last->len += len;
+        return 0;
+      }
+    }
+
+    if(span->nsegs == *cap) {
+      uint32_t new_cap = *cap ? *cap * 2 : 8;
+      struct vm_seg* segs = realloc(span->segs, new_cap * sizeof(struct vm_seg));
+      if(segs == NULL) return -1;
+      span->segs = segs;
+      *cap = new_cap;
+    }
+
+    span->segs[span->nsegs].ptr = ptr;
+    span->segs[span->nsegs].len = len;
+    span->nsegs++;
+    return 0;
+}
+
+/*
+ * n_pin()
+ * -------
+ * Resolves [va, va + len) once and pins every frame behind it. The page
+ * tables are read under each PDE lock, the same lock n_free() clears
+ * entries under, so a frame cannot be unmapped between lookup and pin.
+ * A span is writable host memory, so a read-only space (a snapshot, whose
+ * frames are shared with its source) cannot be pinned.
+ *
+ * Return:
+ *   0  -> Success (span filled; release it with n_unpin())
+ *  -1  -> Failure (the space is read-only, or some page is unmapped or
+ *         pinned too often; nothing pinned)
+ */
+int n_pin(void *va, unsigned int len, struct vm_span *span)
+{
+    pde_t* root = cur_space->pgdir;
+    if(span == NULL) return -1;
+    span->segs = NULL;
+    span->nsegs = 0;
+    if(cur_space->readonly) return -1;
+
+    uint64_t cur = VA2U(va);
+    uint64_t end = cur + len;
+    if(root == NULL || len == 0 || end > (1ULL << VA_BITS)) return -1;
+
+    uint32_t cap = 0;
+    bool failed = false;
+
+    while(cur < end && !failed) {
+      pde_t* pgdir = pgdir_of(root, cur, false);
+      if(pgdir == NULL) {
+        failed = true;
+        break;
+      }
+      uint64_t spn = cur >> PDXSHIFT;
+      uint32_t pgdir_idx = PDX(cur);
+      pthread_mutex_lock(&pde_locks[pgdir_idx]);
+
+      while(cur < end && (cur >> PDXSHIFT) == spn) {
+        // pinning touches the pages, so demand-paged and swapped-out ones
+        // get frames here
+        pde_t pgdir_entry = pgdir[pgdir_idx];
+        paddr_t pa;
+        if(!(pgdir_entry & (IN_USE | PTE_RESERVED))) {
+          failed = true;
+          break;
+        } else if(pgdir_entry & PDE_LARGE) {
+          pa = (pgdir_entry & ~OFFMASK) + (cur & (SUPERPAGE_SIZE - 1));
+        } else {
+          pte_t* pgtbl = pgtbl_upsert(pgdir, pgdir_idx);
+          pte_t* entry = (pgtbl != NULL) ? &pgtbl[PTX(cur)] : NULL;
+          if(entry != NULL && (*entry & (PTE_RESERVED | PTE_SWAPPED)) &&
+             back_page(entry, cur) == -1) {
+            entry = NULL;
+          }
+          // a pin hands out writable memory, so shared pages are copied
+          // first
+          if(entry != NULL && (*entry & PTE_COW) && cow_copy(entry, cur) == -1) {
+            entry = NULL;
+          }
+          if(entry == NULL || !(*entry & IN_USE)) {
+            failed = true;
+            break;
+          }
+          pa = (*entry & ~OFFMASK) + OFF(cur);
+        }
+
+        uint32_t frame = pa >> OFFSET_BITS;
+        if(frame_pins[frame] >= FRAME_PIN_MAX) {
+          failed = true;
+          break;
+        }
+
+        uint32_t chunk = PGSIZE - OFF(cur);
+        if(chunk > end - cur) chunk = end - cur;
+
+        // pin before recording, so an n_unpin() of a partial span is exact
+        __atomic_fetch_add(&frame_pins[frame], 1, __ATOMIC_ACQ_REL);
+        if(span_push(span, &cap, (char*)p_buff + pa, chunk) == -1) {
+          __atomic_fetch_sub(&frame_pins[frame], 1, __ATOMIC_ACQ_REL);
+          failed = true;
+          break;
+        }
+        cur += chunk;
+      }
+
+      pthread_mutex_unlock(&pde_locks[pgdir_idx]);
+    }
+
+    if(failed) {
+      n_unpin(span);
+      return -1;
+    }
+    return 0;
+}
+
+/*
+ * n_unpin()
+ * ---------
+ * Drops the pins taken by n_pin(). A frame whose page was freed while it was
+ * pinned is released here, by its last unpin.
+ *
+ * Return value: None.
+ */
+void n_unpin(struct vm_span *span)
+{
+    if(span == NULL) return;
+
+    for(uint32_t i = 0; i < span->nsegs; i++) {
+      uint32_t first = ((char*)span->segs[i].ptr - (char*)p_buff) >> OFFSET_BITS;
+      uint32_t last = ((char*)span->segs[i].ptr + span->segs[i].len - 1
+                       - (char*)p_buff) >> OFFSET_BITS;
+
+      for(uint32_t frame = first; frame <= last; frame++) frame_unpin(frame);
+    }
+
+    free(span->segs);
+    span->segs = NULL;
+    span->nsegs = 0;
+}
+
+// -----------------------------------------------------------------------------
+// Snapshots
+// -----------------------------------------------------------------------------
+
+/*
+ * n_snapshot()
+ * ------------
+ * Clones the current address space into a new, read-only space. Only the
+ * page tables are copied: every resident page is shared between the two and
+ * marked PTE_COW on both sides, so the source copies a page the first time
+ * it writes to it. Superpages are split and swapped-out pages read back in
+ * first, since sharing works per page frame. Writes racing with the clone
+ * may or may not make it into the snapshot.
+ *
+ * Return: the snapshot (switch to it to read it, free it with
+ *         vm_space_destroy()); NULL on failure.
+ */
+struct vm_space* n_snapshot(void)
+{
+  struct vm_space* src = cur_space;
+  struct vm_space* snap = vm_space_create();
+  if(snap == NULL) return NULL;
+  snap->readonly = true;
+
+  // no allocation may land in the source while it is being cloned
+  pthread_mutex_lock(&multi_op_lock);
+
+  pthread_mutex_lock(&lock);
+  memcpy(snap->v_bmap, src->v_bmap, V_BMAP_WORDS * sizeof(uint64_t));
+  // only the first 2 * V_BMAP_WORDS nodes of each array are in use
+  size_t tree_bytes = 2 * V_BMAP_WORDS * sizeof(uint32_t);
+  memcpy(snap->v_tree->prefix, src->v_tree->prefix, tree_bytes);
+  memcpy(snap->v_tree->suffix, src->v_tree->suffix, tree_bytes);
+  memcpy(snap->v_tree->best, src->v_tree->best, tree_bytes);
+  snap->vpages_used = src->vpages_used;
+  pthread_mutex_unlock(&lock);
+
+  bool failed = false;
+  pde_t* src_dir;
+  for(uint64_t base = 0; !failed && (src_dir = pgdir_next(src->pgdir, &base)) != NULL;
+      base += PGDIR_SPAN) {
+    pde_t* snap_dir = pgdir_of(snap->pgdir, base, true);
+    failed = (snap_dir == NULL);
+
+    for(uint32_t pgdir_idx = 0; pgdir_idx < (1u << PDX_BITS) && !failed; pgdir_idx++) {
+      vaddr_t span = base + ((vaddr_t)pgdir_idx << PDXSHIFT);
+      if((src_dir[pgdir_idx] & PDE_LARGE) && split_superpage(src_dir, span) == -1) {
+        failed = true;
+        break;
+      }
+
+      pthread_mutex_lock(&pde_locks[pgdir_idx]);
+      pde_t pgdir_entry = src_dir[pgdir_idx];
+      if(pgdir_entry == PTE_RESERVED) {
+        snap_dir[pgdir_idx] = PTE_RESERVED;
+      } else if(pgdir_entry & IN_USE) {
+        pte_t* src_tbl = (pte_t*)((char*)p_buff + (pgdir_entry & ~OFFMASK));
+        pte_t* snap_tbl = alloc_frame();
+        failed = (snap_tbl == NULL);
+        if(snap_tbl != NULL) {
+          memset(snap_tbl, 0, PGSIZE);
+          pgtbl_live[((char*)snap_tbl - (char*)p_buff) >> OFFSET_BITS] = 0;
+        }
+
+        for(uint32_t i = 0; !failed && i < (1u << PTX_BITS); i++) {
+          vaddr_t va = span + i * PGSIZE;
+          if((src_tbl[i] & PTE_SWAPPED) && back_page(&src_tbl[i], va) == -1) {
+            failed = true;
+            break;
+          }
+
+          pte_t entry = src_tbl[i];
+          if(entry & IN_USE) {
+            // the snapshot never writes, so its frames are the ones left
+            // behind by copies: the swap hint follows it
+            uint32_t frame = (entry & ~OFFMASK) >> OFFSET_BITS;
+            __atomic_fetch_add(&frame_shares[frame], 1, __ATOMIC_ACQ_REL);
+            __atomic_fetch_or(&src_tbl[i], PTE_COW, __ATOMIC_ACQ_REL);
+            frame_owner[frame] = va | snap->asid;
+            entry = (entry & ~PTE_REFERENCED) | PTE_COW;
+          }
+          snap_tbl[i] = entry;
+          if(entry != 0) pgtbl_count(snap_tbl, 1);
+        }
+
+        // a partly filled table is still consistent, so a failed clone can
+        // be torn down like any other space
+        if(snap_tbl != NULL) {
+          snap_dir[pgdir_idx] = ((char*)snap_tbl - (char*)p_buff) | PDE_TABLE | IN_USE;
+        }
+      }
+      pthread_mutex_unlock(&pde_locks[pgdir_idx]);
+    }
+  }
+
+  pthread_mutex_unlock(&multi_op_lock);
+
+  if(failed) {
+    vm_space_destroy(snap);
+    return NULL;
+  }
+  return snap;
 }
 
 // -----------------------------------------------------------------------------
@@ -463,14 +3585,15 @@ void get_data(void *va, void *val, int size) {
 // -----------------------------------------------------------------------------
 
 /*
- * mat_mult()
- * ----------
- * Performs matrix multiplication of two matrices stored in virtual memory.
- * Each element is accessed and stored using get_data() and put_data().
+ * mat_mult_naive()
+ * ----------------
+ * Element-at-a-time i-j-k product. Each element is accessed and stored using
+ * get_data() and put_data(), so this is exact even when the matrices overlap
+ * or are only partly mapped.
  *
  * Return value: None.
  */
-void mat_mult(void *mat1, void *mat2, int size, void *answer)
+static void mat_mult_naive(void *mat1, void *mat2, int size, void *answer)
 {
     int i, j, k;
     uint32_t a, b, c;
@@ -502,6 +3625,152 @@ void mat_mult(void *mat1, void *mat2, int size, void *answer)
     }
 }
 
+// tile edge, in elements, of the blocked kernel. a row of A, a tile of B and
+// a tile row of C stay cache resident while a tile is processed.
+#define MM_TILE 64
+
+// c[0..MM_TILE) += a * b[0..MM_TILE). the fixed trip count and restrict
+// let the compiler vectorize this at -O2 without runtime checks.
+static inline void mat_axpy_tile(uint32_t* restrict c, const uint32_t* restrict b,
+                                 uint32_t a)
+{
+    for(uint32_t j = 0; j < MM_TILE; j++) c[j] += a * b[j];
+}
+
+/*
+ * mat_kernel()
+ * ------------
+ * C = A * B on host memory, blocked i-k-j. The innermost loop is a unit
+ * stride multiply-add over a tile row of B and C (mat_axpy_tile()).
+ * uint32_t wraps exactly like the element-wise version.
+ */
+static void mat_kernel(const uint32_t* restrict a, const uint32_t* restrict b,
+                       uint32_t* restrict c, uint32_t n)
+{
+    memset(c, 0, (size_t)n * n * sizeof(uint32_t));
+
+    for(uint32_t ii = 0; ii < n; ii += MM_TILE) {
+      uint32_t i_end = (ii + MM_TILE < n) ? ii + MM_TILE : n;
+      for(uint32_t kk = 0; kk < n; kk += MM_TILE) {
+        uint32_t k_end = (kk + MM_TILE < n) ? kk + MM_TILE : n;
+        for(uint32_t jj = 0; jj < n; jj += MM_TILE) {
+          uint32_t j_end = (jj + MM_TILE < n) ? jj + MM_TILE : n;
+
+          for(uint32_t i = ii; i < i_end; i++) {
+            uint32_t* c_row = c + (size_t)i * n + jj;
+            for(uint32_t k = kk; k < k_end; k++) {
+              uint32_t a_ik = a[(size_t)i * n + k];
+              const uint32_t* b_row = b + (size_t)k * n + jj;
+              if(j_end - jj == MM_TILE) {
+                mat_axpy_tile(c_row, b_row, a_ik);
+              } else {
+                for(uint32_t j = 0; j < j_end - jj; j++) c_row[j] += a_ik * b_row[j];
+              }
+            }
+          }
+        }
+      }
+    }
+}
+
+/*
+ * span_host()
+ * -----------
+ * Host buffer for writing a pinned span: its memory directly when it is one
+ * segment, otherwise a private buffer to be scattered back afterwards.
+ *
+ * Return: host pointer; NULL if a buffer could not be allocated.
+ */
+static uint32_t* span_host(struct vm_span* span, size_t bytes)
+{
+    if(span->nsegs == 1) return span->segs[0].ptr;
+    return malloc(bytes);
+}
+
+/*
+ * mat_mult_blocked()
+ * ------------------
+ * Copies both inputs out with copy_data(), which reads them the way
+ * get_data() does, pins only the answer, and multiplies on host memory with
+ * mat_kernel() instead of translating every element. Pinning the inputs
+ * would back their lazy pages, bring swapped ones back and hold shared
+ * frames just to read them. The answer is scattered back into its segments
+ * if it is not one contiguous piece.
+ *
+ * Return: 0 on success; -1 (before touching answer) if the space is
+ *         read-only, an input cannot be read, the answer cannot be pinned
+ *         or a buffer cannot be allocated.
+ */
+static int mat_mult_blocked(void *mat1, void *mat2, uint32_t n, void *answer)
+{
+    size_t bytes = (size_t)n * n * sizeof(uint32_t);
+    struct vm_span s3;
+    uint32_t *a, *b, *c = NULL;
+    int ret = -1;
+
+    // the answer is written through its pin, bypassing put_data()'s check
+    if(cur_space->readonly) return -1;
+
+    a = malloc(bytes);
+    b = malloc(bytes);
+    if(a == NULL || b == NULL ||
+       copy_data(mat1, a, bytes, 0, false) == -1 ||
+       copy_data(mat2, b, bytes, 0, false) == -1 ||
+       n_pin(answer, bytes, &s3) == -1) {
+      free(a);
+      free(b);
+      return -1;
+    }
+
+    c = span_host(&s3, bytes);
+    if(c != NULL) {
+      mat_kernel(a, b, c, n);
+
+      if(s3.nsegs != 1) {
+        size_t done = 0;
+        for(uint32_t i = 0; i < s3.nsegs; i++) {
+          memcpy(s3.segs[i].ptr, (char*)c + done, s3.segs[i].len);
+          done += s3.segs[i].len;
+        }
+        free(c);
+      }
+      ret = 0;
+    }
+
+    n_unpin(&s3);
+    free(a);
+    free(b);
+    return ret;
+}
+
+/*
+ * mat_mult()
+ * ----------
+ * Performs matrix multiplication of two matrices stored in virtual memory.
+ * The inputs are copied out once and the answer is written through a pinned
+ * span by a cache-blocked kernel; an answer that overlaps an input, or a
+ * matrix that is not fully mapped, falls back to the element-wise get_data()/put_data()
+ * version, which gives the same results. In a read-only space the fallback's
+ * put_data() calls fail, so answer is left untouched.
+ *
+ * Return value: None.
+ */
+void mat_mult(void *mat1, void *mat2, int size, void *answer)
+{
+    if(size <= 0) return;
+
+    uint64_t bytes = (uint64_t)size * size * sizeof(uint32_t);
+    uint64_t m1 = VA2U(mat1), m2 = VA2U(mat2), ans = VA2U(answer);
+    bool overlap = (ans < m1 + bytes && m1 < ans + bytes) ||
+                   (ans < m2 + bytes && m2 < ans + bytes);
+
+    if(bytes <= INT_MAX && !overlap &&
+       mat_mult_blocked(mat1, mat2, size, answer) == 0) {
+      return;
+    }
+    mat_mult_naive(mat1, mat2, size, answer);
+}
+
 
 // -----------------------------------------------------------------------------
 // Helper Functions 
@@ -532,38 +3801,319 @@ int get_bit(char* bmap, int idx) {
   return ret;
 }
 
-void* alloc_frame() {
-  for(uint32_t i = 0; i < MAX_NUM_FRAMES; i++) {
+// sets or clears bits [start, start + n) of a word bitmap, a word at a time
+static void bmap_fill(uint64_t* words, uint32_t start, uint32_t n, bool set) {
+  if(n == 0) return;
 
-    pthread_mutex_lock(&lock);
-    if(get_bit(p_bmap, i) == 0) {
-      set_bit(p_bmap, i);
-      void* res = (void*)(p_buff + (i * PGSIZE));
-      pthread_mutex_unlock(&lock);
-      return res; 
+  uint32_t end = start + n - 1;
+  uint32_t first_w = start / 64, last_w = end / 64;
+
+  for(uint32_t w = first_w; w <= last_w; w++) {
+    uint32_t lo = (w == first_w) ? start % 64 : 0;
+    uint32_t hi = (w == last_w) ? end % 64 : 63;
+    uint64_t mask = (~0ULL >> (63 - hi)) & (~0ULL << lo);
+
+    if(set) words[w] |= mask;
+    else words[w] &= ~mask;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Physical Frames
+// -----------------------------------------------------------------------------
+
+/*
+ * frames_reserve()
+ * ----------------
+ * Claims up to n free frames from p_bmap, scanning whole words from the
+ * next-fit cursor and wrapping around at most once.
+ *
+ * Return: number of frame indices written to out (0 if memory is full).
+ */
+static uint32_t frames_reserve(uint32_t* out, uint32_t n) {
+  uint64_t* words = (uint64_t*)p_bmap;
+  uint32_t got = 0;
+
+  pthread_mutex_lock(&frame_lock);
+  uint32_t w = frame_cursor;
+  for(uint32_t scanned = 0; scanned <= P_BMAP_WORDS; scanned++) {
+    uint64_t free_bits = ~words[w];
+    while(free_bits && got < n) {
+      uint32_t bit = __builtin_ctzll(free_bits);
+      free_bits &= free_bits - 1;
+      words[w] |= 1ULL << bit;
+      out[got++] = w * 64 + bit;
     }
-    pthread_mutex_unlock(&lock);
 
+    // stay on this word if it may still hold free frames
+    if(got == n) break;
+    w = (w + 1) % P_BMAP_WORDS;
+  }
+  frame_cursor = w;
+  pthread_mutex_unlock(&frame_lock);
+
+  return got;
+}
+
+/*
+ * frames_release()
+ * ----------------
+ * Returns frames to p_bmap.
+ */
+static void frames_release(const uint32_t* frames, uint32_t n) {
+  if(n == 0) return;
+
+  uint64_t* words = (uint64_t*)p_bmap;
+  pthread_mutex_lock(&frame_lock);
+  for(uint32_t i = 0; i < n; i++) {
+    words[frames[i] / 64] &= ~(1ULL << (frames[i] % 64));
+  }
+  pthread_mutex_unlock(&frame_lock);
+}
+
+/*
+ * frames_reserve_large()
+ * ----------------------
+ * Claims PGS_PER_SUPERPAGE contiguous frames aligned to their own size, so
+ * the run covers whole words of p_bmap that must all be clear.
+ *
+ * Return: index of the first frame; -1 if no such run is free.
+ */
+static int64_t frames_reserve_large(void) {
+  uint64_t* words = (uint64_t*)p_bmap;
+  uint32_t run_words = PGS_PER_SUPERPAGE / 64;
+  int64_t first = -1;
+
+  pthread_mutex_lock(&frame_lock);
+  for(uint32_t w = 0; w < P_BMAP_WORDS && first < 0; w += run_words) {
+    uint32_t i = 0;
+    while(i < run_words && words[w + i] == 0) i++;
+    if(i < run_words) continue;
+
+    memset(&words[w], 0xFF, run_words * sizeof(uint64_t));
+    first = (int64_t)w * 64;
+  }
+  pthread_mutex_unlock(&frame_lock);
+
+  return first;
+}
+
+/*
+ * frames_release_run()
+ * --------------------
+ * Returns a run of n contiguous frames to p_bmap.
+ */
+static void frames_release_run(uint32_t first, uint32_t n) {
+  pthread_mutex_lock(&frame_lock);
+  bmap_fill(p_bmap, first, n, false);
+  pthread_mutex_unlock(&frame_lock);
+}
+
+/*
+ * frame_retire()
+ * --------------
+ * Called once a frame's mapping is gone. A frame still shared copy-on-write
+ * stays with its other mappings. Otherwise an unpinned frame may be released
+ * right away; a pinned one is flagged so its last n_unpin() releases it.
+ * Pins are only taken under the PDE lock while the frame is mapped, so the
+ * count can only drop here.
+ *
+ * Return: true if the caller should release the frame now.
+ */
+static bool frame_retire(uint32_t frame) {
+  uint16_t shares = __atomic_load_n(&frame_shares[frame], __ATOMIC_ACQUIRE);
+  while(shares != 0) {
+    if(__atomic_compare_exchange_n(&frame_shares[frame], &shares, shares - 1,
+                                   false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      return false;
+    }
+  }
+
+  uint16_t pins = __atomic_load_n(&frame_pins[frame], __ATOMIC_SEQ_CST);
+  while(pins != 0) {
+    if(__atomic_compare_exchange_n(&frame_pins[frame], &pins, pins | FRAME_PIN_FREED,
+                                   false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * frame_unpin()
+ * -------------
+ * Drops one pin. The last pin of a frame whose mapping is already gone
+ * releases it.
+ */
+static void frame_unpin(uint32_t frame) {
+  uint16_t old = __atomic_fetch_sub(&frame_pins[frame], 1, __ATOMIC_SEQ_CST);
+  if(old == (FRAME_PIN_FREED | 1)) {
+    __atomic_store_n(&frame_pins[frame], 0, __ATOMIC_RELEASE);
+    free_frame((char*)p_buff + (size_t)frame * PGSIZE);
+  }
+}
+
+/*
+ * frames_take()
+ * -------------
+ * Takes n frames for a bulk mapping: the calling thread's magazine is drained
+ * first and the remainder is reserved from p_bmap in one pass. If the pool
+ * runs dry, pages are evicted to swap for the rest.
+ *
+ * Return: 0 on success; -1 (with nothing taken) if fewer than n are free.
+ */
+static int frames_take(uint32_t* out, uint32_t n) {
+  uint32_t got = 0;
+  while(got < n && frame_mag.count > 0) {
+    out[got++] = frame_mag.frames[--frame_mag.count];
+  }
+  if(got < n) got += frames_reserve(out + got, n - got);
+  while(got < n) {
+    int64_t victim = swap_out();
+    if(victim < 0) break;
+    out[got++] = victim;
+  }
+
+  if(got < n) {
+    frames_release(out, got);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * alloc_frame()
+ * -------------
+ * Takes a frame from the calling thread's magazine, refilling it with a
+ * batch from p_bmap when empty, or evicting a page to swap when the pool
+ * is exhausted.
+ *
+ * Return: pointer to the frame inside p_buff; NULL if memory and swap are
+ *         both full.
+ */
+static void* alloc_frame(void) {
+  if(frame_mag.count == 0) {
+    vm_thread_register();
+    frame_mag.count = frames_reserve(frame_mag.frames, FRAME_MAG_BATCH);
+    if(frame_mag.count == 0) {
+      // bitmap is full (i.e. out of memory): make room by swapping out
+      int64_t victim = swap_out();
+      if(victim < 0) return NULL;
+      return (char*)p_buff + ((size_t)victim * PGSIZE);
+    }
+  }
+
+  uint32_t frame = frame_mag.frames[--frame_mag.count];
+  return (char*)p_buff + ((size_t)frame * PGSIZE);
+}
+
+/*
+ * free_frame()
+ * ------------
+ * Puts a frame into the calling thread's magazine. When the magazine is full
+ * its oldest batch is drained back to p_bmap first.
+ */
+static void free_frame(void* pa) {
+  uint32_t frame = ((char*)pa - (char*)p_buff) >> OFFSET_BITS;
+
+  // the magazine goes back to p_bmap when the thread exits
+  vm_thread_register();
+  if(frame_mag.count == FRAME_MAG_SIZE) {
+    frames_release(frame_mag.frames, FRAME_MAG_BATCH);
+    memmove(frame_mag.frames, frame_mag.frames + FRAME_MAG_BATCH,
+            (FRAME_MAG_SIZE - FRAME_MAG_BATCH) * sizeof(uint32_t));
+    frame_mag.count -= FRAME_MAG_BATCH;
+  }
+
+  frame_mag.frames[frame_mag.count++] = frame;
+}
+
+/*
+ * page_pin()
+ * ----------
+ * Resolves the page frame behind va for a copy in direction dir (1 writes
+ * to simulated memory), backing a demand-paged or swapped-out page and
+ * breaking copy-on-write first where needed, and pins the frame so that
+ * swap_out() cannot evict it (nor n_free() release it) until frame_unpin().
+ *
+ * Return: host address of va; NULL if the page cannot be backed.
+ */
+static char* page_pin(pde_t* pgdir, vaddr_t va, int dir, uint32_t* frame_out) {
+  for(;;) {
+    // the PTE is read until the pin is taken; after that the pin, not the
+    // walk, keeps the frame
+    walk_begin();
+    pte_t* pte = translate_walk(pgdir, U2VA(va));
+    if(pte == NULL) {
+      // first touch of a demand-paged page, or a page in swap: back it and
+      // retry
+      walk_end();
+      if(fault_in(va) == -1) return NULL;
+      continue;
+    }
+
+    pte_t entry = __atomic_load_n(pte, __ATOMIC_ACQUIRE);
+    if(!entry_live(pte, entry)) {  // freed or split since translate()
+      walk_end();
+      continue;
+    }
+
+    // the first write to a page shared with a snapshot gets its own frame
+    if(dir == 1 && (entry & PTE_COW)) {
+      walk_end();
+      if(cow_break(va) == -1) return NULL;
+      continue;
+    }
+
+    // a superpage is one contiguous SUPERPAGE_SIZE frame
+    uint32_t frame_mask = (entry & PDE_LARGE) ? (1u << PDXSHIFT) - 1 : OFFMASK;
+    paddr_t pa_offset = (entry & ~OFFMASK) + (va & frame_mask);
+    uint32_t frame = pa_offset >> OFFSET_BITS;
+
+    // the entry is re-read once the pin is visible; swap_out() checks the
+    // pins after changing the entry, so one of the two always backs off.
+    __atomic_fetch_add(&frame_pins[frame], 1, __ATOMIC_SEQ_CST);
+    pte_t now = __atomic_load_n(pte, __ATOMIC_SEQ_CST);
+    walk_end();
+    if((now ^ entry) & ~PTE_REFERENCED) {
+      frame_unpin(frame);
+      continue;
+    }
+
+    *frame_out = frame;
+    return (char*)p_buff + pa_offset;
   }
-  return NULL;        // bitmap is full (i.e. out of memory) 
 }
 
-static int copy_data(void* va, void* val, int size, int dir) {
+/*
+ * copy_data()
+ * -----------
+ * Moves size bytes between a user buffer and simulated memory, one page
+ * frame at a time. dir 1 writes to simulated memory, dir 0 reads from it.
+ * memcpy runs unlocked unless locked is set, in which case each chunk is
+ * copied under its frame's stripe lock.
+ *
+ * Return: 0 on success, -1 on failure.
+ */
+static int copy_data(void* va, void* val, int size, int dir, bool locked) {
+  pde_t* pgdir = cur_space->pgdir;
   if(dir != 0 && dir != 1) return -1;
 
   if(va == NULL || val == NULL || size <= 0)
     return -1;
 
-  vaddr32_t va_base = VA2U(va);
+  if(dir == 1 && cur_space->readonly) return -1;
+
+  vaddr_t va_base = VA2U(va);
   int num_bytes_written = 0;
 
   while(num_bytes_written < size) {
-    pte_t* pte = translate(pgdir, U2VA(va_base));
-    if(pte == NULL) return -1;
+    // copy one page frame at a time: the unit that is pinned and locked
+    uint32_t frame;
+    void* pa_ptr = page_pin(pgdir, va_base, dir, &frame);
+    if(pa_ptr == NULL) return -1;
 
-    uint32_t offset = OFF(va_base);
-    uint32_t rem_frame_bytes = PGSIZE - offset;
-    
+    uint32_t rem_frame_bytes = PGSIZE - OFF(va_base);
     uint32_t chunk_size; 
     if((size - num_bytes_written) <= rem_frame_bytes) {
       chunk_size = size - num_bytes_written; 
@@ -571,17 +4121,25 @@ static int copy_data(void* va, void* val, int size, int dir) {
       chunk_size = rem_frame_bytes;
     }
 
-    paddr32_t pa_offset = (*pte & ~OFFMASK) + offset;
-    void* pa_ptr = (char*)p_buff + pa_offset;
     void* ext_ptr = val + num_bytes_written;
 
-    pthread_mutex_lock(&lock);
+    pthread_mutex_t* stripe = NULL;
+    if(locked) {
+      stripe = &copy_locks[frame % COPY_LOCK_STRIPES];
+      pthread_mutex_lock(stripe);
+    }
+
     if(dir == 1) {
       memcpy(pa_ptr, ext_ptr, chunk_size);
     } else {
       memcpy(ext_ptr, pa_ptr, chunk_size);
     }
-    pthread_mutex_unlock(&lock);
+
+    if(stripe != NULL) pthread_mutex_unlock(stripe);
+    frame_unpin(frame);
+
+    if(dir == 1) STAT_ADD(bytes_written, chunk_size);
+    else STAT_ADD(bytes_read, chunk_size);
 
     va_base += chunk_size;
     num_bytes_written += chunk_size;
@@ -589,3 +4147,297 @@ static int copy_data(void* va, void* val, int size, int dir) {
   return 0; 
 }
 
+// page of a vectored copy element, relative to the lowest page of its batch
+#define IOV_PAGE(v, lo) ((VA2U((v).va) >> OFFSET_BITS) - (lo))
+
+/*
+ * iov_sort()
+ * ----------
+ * Orders the elements of a batch by page with an LSD radix sort over the
+ * page numbers relative to the lowest one, 8 bits a pass, so a batch that
+ * spans fewer than 256 pages takes a single counting pass. The sort is
+ * stable: elements of one page keep their batch order.
+ *
+ * Return: malloc'd array whose first cnt entries are the element indices
+ *         in page order; NULL if out of memory.
+ */
+static uint32_t* iov_sort(const struct vm_iovec* iov, int cnt) {
+  vaddr_t lo = (vaddr_t)-1, hi = 0;
+  for(int i = 0; i < cnt; i++) {
+    vaddr_t vpn = VA2U(iov[i].va) >> OFFSET_BITS;
+    if(vpn < lo) lo = vpn;
+    if(vpn > hi) hi = vpn;
+  }
+
+  uint32_t* base = malloc(2 * (size_t)cnt * sizeof(uint32_t));
+  if(base == NULL) return NULL;
+  uint32_t* idx = base;
+  uint32_t* tmp = base + cnt;
+  for(int i = 0; i < cnt; i++) idx[i] = i;
+
+  uint32_t shift = 0;
+  do {
+    uint32_t pos[257] = { 0 };
+    for(int i = 0; i < cnt; i++) pos[((IOV_PAGE(iov[i], lo) >> shift) & 0xff) + 1]++;
+    for(int b = 0; b < 256; b++) pos[b + 1] += pos[b];
+    for(int i = 0; i < cnt; i++) {
+      tmp[pos[(IOV_PAGE(iov[idx[i]], lo) >> shift) & 0xff]++] = idx[i];
+    }
+
+    uint32_t* t = idx; idx = tmp; tmp = t;
+    shift += 8;
+  } while(shift < 8 * sizeof(vaddr_t) && ((hi - lo) >> shift) != 0);
+
+  // hand back the result in the front half
+  if(idx != base) memcpy(base, idx, (size_t)cnt * sizeof(uint32_t));
+  return base;
+}
+
+// memcpy() of the small, fixed sizes that field-at-a-time callers move,
+// which the compiler turns into single loads and stores
+static inline void copy_small(void* dst, const void* src, uint32_t n) {
+  switch(n) {
+    case 1: memcpy(dst, src, 1); break;
+    case 2: memcpy(dst, src, 2); break;
+    case 4: memcpy(dst, src, 4); break;
+    case 8: memcpy(dst, src, 8); break;
+    default: memcpy(dst, src, n); break;
+  }
+}
+
+/*
+ * copy_datav()
+ * ------------
+ * Moves a batch of elements between user buffers and simulated memory in
+ * direction dir (see copy_data()). Elements are visited grouped by page,
+ * and the frame of the current page stays pinned for as long as the next
+ * elements fall into it, so a page costs one translation per batch instead
+ * of one per element. A batch whose pages already ascend or descend is
+ * visited as given; any other is sorted by page first, keeping the order
+ * of the elements within a page.
+ *
+ * Return: 0 on success, -1 on failure.
+ */
+static int copy_datav(const struct vm_iovec* iov, int cnt, int dir) {
+  pde_t* pgdir = cur_space->pgdir;
+  if(iov == NULL || cnt < 0) return -1;
+  if(dir == 1 && cur_space->readonly) return -1;
+
+  // only the page order matters; stop looking once it is neither
+  bool ascending = true, descending = true;
+  for(int i = 1; i < cnt && (ascending || descending); i++) {
+    vaddr_t prev = VA2U(iov[i - 1].va) >> OFFSET_BITS;
+    vaddr_t vpn = VA2U(iov[i].va) >> OFFSET_BITS;
+    if(vpn < prev) ascending = false;
+    if(vpn > prev) descending = false;
+  }
+
+  uint32_t* order = NULL;
+  if(!ascending && !descending) {
+    order = iov_sort(iov, cnt);
+    if(order == NULL) return -1;
+  }
+
+  vaddr_t cur_vpn = (vaddr_t)-1;   // page whose frame is pinned, if any
+  char* page = NULL;
+  uint32_t frame = 0;
+  uint64_t bytes = 0;
+  int ret = 0;
+
+  for(int k = 0; k < cnt && ret == 0; k++) {
+    const struct vm_iovec* v = &iov[order != NULL ? order[k] : (uint32_t)k];
+    vaddr_t va = VA2U(v->va);
+    char* buf = v->buf;
+    uint32_t left = v->len;
+    if(left > 0 && (v->va == NULL || buf == NULL)) {
+      ret = -1;
+      break;
+    }
+
+    // common case: a small element inside the page already pinned
+    if((va >> OFFSET_BITS) == cur_vpn && OFF(va) + left <= PGSIZE) {
+      if(dir == 1) copy_small(page + OFF(va), buf, left);
+      else copy_small(buf, page + OFF(va), left);
+      bytes += left;
+      continue;
+    }
+
+    while(left > 0) {
+      vaddr_t vpn = va >> OFFSET_BITS;
+      if(vpn != cur_vpn) {
+        if(page != NULL) frame_unpin(frame);
+        page = page_pin(pgdir, va & ~OFFMASK, dir, &frame);
+        cur_vpn = vpn;
+        if(page == NULL) {
+          ret = -1;
+          break;
+        }
+      }
+
+      uint32_t chunk_size = PGSIZE - OFF(va);
+      if(left < chunk_size) chunk_size = left;
+
+      if(dir == 1) {
+        copy_small(page + OFF(va), buf, chunk_size);
+      } else {
+        copy_small(buf, page + OFF(va), chunk_size);
+      }
+
+      va += chunk_size;
+      buf += chunk_size;
+      left -= chunk_size;
+      bytes += chunk_size;
+    }
+  }
+
+  if(page != NULL) frame_unpin(frame);
+  free(order);
+
+  if(dir == 1) STAT_ADD(bytes_written, bytes);
+  else STAT_ADD(bytes_read, bytes);
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+// Swap
+// -----------------------------------------------------------------------------
+
+/*
+ * swap_open()
+ * -----------
+ * Creates the swap file and its slot bitmap on first use, in $TMPDIR (or
+ * SWAP_DIR without one) rather than the caller's working directory. The
+ * file is unlinked at once and lives as long as its descriptor. Caller
+ * holds swap_lock.
+ *
+ * Return: 0 on success, -1 if the file could not be created.
+ */
+static int swap_open(void) {
+  if(swap_fd >= 0) return 0;
+
+  swap_bmap = calloc(SWAP_SLOTS / 64, sizeof(uint64_t));
+  if(swap_bmap == NULL) return -1;
+
+  const char* dir = getenv("TMPDIR");
+  if(dir == NULL || dir[0] == '\0') dir = SWAP_DIR;
+
+  char path[4096];
+  int path_len = snprintf(path, sizeof(path), "%s/%s", dir, SWAP_FILE_TMPL);
+  swap_fd = (path_len > 0 && (size_t)path_len < sizeof(path)) ? mkstemp(path) : -1;
+  if(swap_fd < 0) {
+    perror("swap file");
+    free(swap_bmap);
+    swap_bmap = NULL;
+    return -1;
+  }
+  unlink(path);
+  return 0;
+}
+
+/*
+ * swap_slot_alloc()
+ * -----------------
+ * Claims a free swap slot, next-fit a word at a time. Caller holds
+ * swap_lock.
+ *
+ * Return: slot index; -1 if swap is full.
+ */
+static int64_t swap_slot_alloc(void) {
+  for(uint32_t scanned = 0; scanned < SWAP_SLOTS / 64; scanned++) {
+    uint32_t w = (swap_cursor + scanned) % (SWAP_SLOTS / 64);
+    if(~swap_bmap[w] == 0) continue;
+
+    uint32_t bit = __builtin_ctzll(~swap_bmap[w]);
+    swap_bmap[w] |= 1ULL << bit;
+    swap_cursor = w;
+    return (int64_t)w * 64 + bit;
+  }
+  return -1;
+}
+
+static void swap_slot_free(uint32_t slot) {
+  pthread_mutex_lock(&swap_lock);
+  swap_bmap[slot / 64] &= ~(1ULL << (slot % 64));
+  pthread_mutex_unlock(&swap_lock);
+}
+
+static int swap_read(uint32_t slot, void* frame) {
+  ssize_t got = pread(swap_fd, frame, PGSIZE, (off_t)slot * PGSIZE);
+  return (got == PGSIZE) ? 0 : -1;
+}
+
+/*
+ * swap_out()
+ * ----------
+ * Evicts one page to swap and hands its frame to the caller. The CLOCK
+ * hand sweeps the frames: a page with PTE_REFERENCED set loses the bit and
+ * gets a second chance, the first page found without it is the victim.
+ * Superpages, page tables and pinned frames are skipped. PDE locks are only
+ * try-locked, because the caller may already hold one.
+ *
+ * Return: index of the freed frame; -1 if nothing could be evicted.
+ */
+static int64_t swap_out(void) {
+  pthread_mutex_lock(&swap_lock);
+  int64_t slot = (swap_open() == 0) ? swap_slot_alloc() : -1;
+  if(slot < 0) {
+    pthread_mutex_unlock(&swap_lock);
+    return -1;
+  }
+
+  int64_t victim = -1;
+  bool io_error = false;
+  for(uint32_t step = 0; step < 2 * MAX_NUM_FRAMES && victim < 0 && !io_error; step++) {
+    uint32_t frame = clock_hand;
+    clock_hand = (clock_hand + 1) % MAX_NUM_FRAMES;
+
+    // frame_owner is a hint; the frame is a victim only if the page table
+    // of its space still maps its virtual address to it
+    vaddr_t owner = frame_owner[frame];
+    struct vm_space* space = spaces[owner & OFFMASK];
+    if(space == NULL) continue;
+
+    vaddr_t va = owner & ~OFFMASK;
+    pde_t* pgdir = pgdir_of(space->pgdir, va, false);
+    uint32_t pgdir_idx = PDX(va);
+    if(pgdir == NULL || pthread_mutex_trylock(&pde_locks[pgdir_idx]) != 0) continue;
+
+    pde_t pgdir_entry = pgdir[pgdir_idx];
+    if((pgdir_entry & IN_USE) && !(pgdir_entry & PDE_LARGE)) {
+      pte_t* pgtbl = (pte_t*)((char*)p_buff + (pgdir_entry & ~OFFMASK));
+      pte_t* entry = &pgtbl[PTX(va)];
+      pte_t e = __atomic_load_n(entry, __ATOMIC_SEQ_CST);
+
+      if(!(e & IN_USE) || ((e & ~OFFMASK) >> OFFSET_BITS) != frame ||
+         __atomic_load_n(&frame_shares[frame], __ATOMIC_ACQUIRE) != 0 ||
+         __atomic_load_n(&frame_pins[frame], __ATOMIC_SEQ_CST) != 0) {
+        // not a resident, unshared, unpinned page of its own
+      } else if(e & PTE_REFERENCED) {
+        __atomic_fetch_and(entry, ~PTE_REFERENCED, __ATOMIC_RELAXED);
+      } else {
+        pte_t swapped = ((uint32_t)slot * PGSIZE) | PTE_SWAPPED;
+        if(__atomic_compare_exchange_n(entry, &e, swapped, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+          // a copy_data() that pinned the frame before the entry changed
+          // wins; put the page back
+          if(__atomic_load_n(&frame_pins[frame], __ATOMIC_SEQ_CST) != 0) {
+            __atomic_store_n(entry, e, __ATOMIC_RELEASE);
+          } else if(pwrite(swap_fd, (char*)p_buff + (size_t)frame * PGSIZE,
+                           PGSIZE, (off_t)slot * PGSIZE) != PGSIZE) {
+            __atomic_store_n(entry, e, __ATOMIC_RELEASE);
+            io_error = true;
+          } else {
+            victim = frame;
+          }
+        }
+      }
+    }
+    pthread_mutex_unlock(&pde_locks[pgdir_idx]);
+  }
+
+  if(victim < 0) swap_bmap[slot / 64] &= ~(1ULL << (slot % 64));
+  pthread_mutex_unlock(&swap_lock);
+
+  if(victim >= 0) tlb_shootdown();
+  return victim;
+}
@@ -12,7 +12,8 @@
  *  Virtual Memory Simulation Header
  * ============================================================================
  *  This header defines co
- *  for implementing a simulated 32-bit virtual memory system.
+ *  for implementing a simulated 32-bit (or, built with VA_BITS=48, 48-bit)
+ *  virtual memory system.
  *
  *  Students will:
  *   - Fill in missing constants and macros for address translation.
@@ -30,40 +31,128 @@
 //  Memory and Paging Configuration
 // -----------------------------------------------------------------------------
 
+// the address width is fixed at build time (make VA_BITS=48). 32-bit
+// addresses are translated by a page directory and page tables of 32-bit
+// entries. 48-bit ones have two more levels above the page directory, and
+// 64-bit entries; the upper tables are only allocated once an address below
+// them is mapped. n_malloc() hands out addresses below MAX_MEMSIZE, since
+// the free-page bitmap and extent tree of a space grow with it; map_page()
+// takes any address.
+#ifndef VA_BITS
 #define VA_BITS        32u           // Simulated virtual address width
-#define PGSIZE         4096u         // Page size = 4 KB
+#endif
 
+#if VA_BITS == 32
 #define MAX_MEMSIZE    (1ULL << 32)  // Max virtual memory = 4 GB
-#define MEMSIZE        (1ULL << 30)  // Simulated physical memory = 1 GB
+#elif VA_BITS == 48
+#define MAX_MEMSIZE    (1ULL << 36)  // Max virtual memory (heap) = 64 GB
+#else
+#error "VA_BITS must be 32 or 48"
+#endif
+
+// the page size, physical memory size, PDX/PTX split and TLB size are chosen
+// at startup (see struct vm_config and vm_init()). these are the defaults,
+// which lazy initialization uses, and the bounds a config must stay within.
+#define DEFAULT_PGSIZE   4096u            // Page size = 4 KB
+#define DEFAULT_MEMSIZE  (1ULL << 30)     // Simulated physical memory = 1 GB
+#define MIN_PGSIZE       4096u
+#define MAX_PGSIZE       (64u * 1024)
+#define MAX_PHYS_MEMSIZE (1ULL << 31)     // frame offsets stay below 2^31
 
 // note: PGSIZE is always a power of 2
 // thus, it can be written as a binary number with a corresponding MSB of 1 and 
 // a string of trailing 0s. The number of trailing zeros will match the power!
 // ex: 4KB = 4096 bytes = 2^12 bytes (0b1_000_000_000_000)
-#define OFFSET_BITS    __builtin_ctz(PGSIZE)
-#define PDX_BITS       ((32 - OFFSET_BITS) / 2)
-#define PTX_BITS       ((32 - OFFSET_BITS) - PDX_BITS)
+// neither index may be wider than with MIN_PGSIZE pages split evenly (or,
+// for 48-bit addresses, than a table filling a MAX_PGSIZE frame), so
+// tables sized by these bounds fit every layout.
+#if VA_BITS == 32
+#define MAX_PDX_BITS   ((32 - __builtin_ctz(MIN_PGSIZE)) / 2)
+#define MIN_PDX_SHIFT  (32 - MAX_PDX_BITS)
+#else
+#define MAX_PDX_BITS   (__builtin_ctz(MAX_PGSIZE) - 3)
+#define MIN_PDX_SHIFT  (2 * __builtin_ctz(MIN_PGSIZE) - 3)
+#endif
+#define MAX_PTX_BITS   MAX_PDX_BITS
+#define MIN_PTX_BITS   6             // a superpage covers whole p_bmap words
+
+// the layout in effect. it is fixed before memory is initialized and never
+// changes afterwards, so it is read without locking. shifts and masks are
+// precomputed and share one cache line, so decoding an address stays a
+// shift and a mask.
+struct vm_layout {
+  uint32_t pgsize;
+  uint32_t offset_bits;
+  uint32_t pdx_bits;
+  uint32_t ptx_bits;
+  uint32_t pdx_shift;      // offset_bits + ptx_bits
+  uint32_t off_mask;
+  uint32_t ptx_mask;
+  uint32_t num_frames;
+  uint64_t memsize;
+  uint32_t tlb_entries;
+  uint32_t tlb_sets;
+  uint32_t tlb_set_bits;
+  uint32_t pdx_mask;
+  // the levels above the page directory, which only 48-bit addresses have:
+  // p3 tables name page directories, the p4 table (the root of a space)
+  // names p3 tables
+  uint32_t p3_shift;
+  uint32_t p3_mask;
+  uint32_t p4_shift;
+  uint32_t p4_bits;
+} __attribute__((aligned(64)));
+
+extern struct vm_layout vm_layout;
+
+#define PGSIZE         (vm_layout.pgsize)
+#define MEMSIZE        (vm_layout.memsize)
+#define OFFSET_BITS    (vm_layout.offset_bits)
+#define PDX_BITS       (vm_layout.pdx_bits)
+#define PTX_BITS       (vm_layout.ptx_bits)
 
 // --- Constants for bit shifts and masks -- 
-#define PDXSHIFT       (PTX_BITS + OFFSET_BITS)
+#define PDXSHIFT       (vm_layout.pdx_shift)
 #define PTXSHIFT       OFFSET_BITS              
-#define PXMASK         ((1 << PTX_BITS) - 1)   
-#define OFFMASK        ((1 << OFFSET_BITS) - 1) 
-#define MAX_NUM_FRAMES ((uint32_t)MEMSIZE / PGSIZE)
+#define PXMASK         (vm_layout.ptx_mask)
+#define OFFMASK        ((vaddr_t)vm_layout.off_mask)
+#define MAX_NUM_FRAMES (vm_layout.num_frames)
 
 // --- Macros to extract address components ---
-#define PDX(va)        ((va) >> (OFFSET_BITS + PTX_BITS))             /** compute directory idx from virtual addr **/
-#define PTX(va)        (((va) >> OFFSET_BITS) & ((1 << PTX_BITS) - 1))  /** compute table idx from virtual addr **/
-#define OFF(va)        ((va) & ((1 << OFFSET_BITS) - 1))              /** compute page offset from virtual addr **/
+#if VA_BITS == 32
+#define PDX(va)        ((va) >> PDXSHIFT)                 /** compute directory idx from virtual addr **/
+#define ROOT_BITS      PDX_BITS                           // the page directory is the root
+#else
+#define P3SHIFT        (vm_layout.p3_shift)
+#define P4SHIFT        (vm_layout.p4_shift)
+#define P4X(va)        ((va) >> P4SHIFT)
+#define P3X(va)        (((va) >> P3SHIFT) & vm_layout.p3_mask)
+#define PDX(va)        (((va) >> PDXSHIFT) & vm_layout.pdx_mask)
+#define ROOT_BITS      (vm_layout.p4_bits)
+#endif
+#define PTX(va)        (((va) >> OFFSET_BITS) & PXMASK)  /** compute table idx from virtual addr **/
+#define OFF(va)        ((va) & OFFMASK)                   /** compute page offset from virtual addr **/
 
 // -----------------------------------------------------------------------------
 //  Type Definitions
 // -----------------------------------------------------------------------------
 
-typedef uint32_t vaddr32_t;   // Simulated 32-bit virtual address
-typedef uint32_t paddr32_t;   // Simulated 32-bit physical address
+#if VA_BITS == 32
+typedef uint32_t vaddr_t;     // Simulated 32-bit virtual address
 typedef uint32_t pte_t;       // Page table entry
 typedef uint32_t pde_t;       // Page directory entry
+#else
+typedef uint64_t vaddr_t;     // Simulated 48-bit virtual address
+typedef uint64_t pte_t;       // Page table entry
+typedef uint64_t pde_t;       // Page directory (or upper table) entry
+#endif
+typedef uint32_t paddr_t;     // Simulated physical address (p_buff offset)
+
+#if VA_BITS == 32
+// names from before 48-bit addresses, kept so existing callers still build
+typedef vaddr_t vaddr32_t;
+typedef paddr_t paddr32_t;
+#endif
 
 // -----------------------------------------------------------------------------
 //  Page Table Flags (Students fill as needed)
@@ -72,27 +161,259 @@ typedef uint32_t pde_t;       // Page directory entry
 #define PFN_SHIFT         /** TODO: number of bits to shift**/
 #define IN_USE 0x01
 
+// a PDE (or upper table entry) with PDE_TABLE names the next table down
+// rather than mapping memory, so a cached pointer to it is never a live
+// translation
+#define PDE_TABLE 0x40
+
+// a PDE with PDE_LARGE set maps its whole region (4 MB in the default
+// layout) directly onto PGS_PER_SUPERPAGE physically contiguous frames
+// instead of naming a page table. n_malloc() uses superpages for allocations of SUPERPAGE_SIZE or more.
+#define PDE_LARGE 0x02
+#define PGS_PER_SUPERPAGE  (1u << PTX_BITS)
+#define SUPERPAGE_SIZE     (PGS_PER_SUPERPAGE * PGSIZE)
+#define MAX_PGS_PER_SUPERPAGE (1u << MAX_PTX_BITS)
+
+// a PTE (or a whole PDE) holding just PTE_RESERVED belongs to an allocation
+// from n_malloc_lazy() that has not been touched yet: it has no frame and
+// is not IN_USE. the first access backs it with a zeroed frame.
+#define PTE_RESERVED 0x04
+
+// a PTE with PTE_SWAPPED is not present: its page lives in swap, and the
+// bits above OFFMASK hold the swap slot instead of a frame. PTE_REFERENCED
+// is set by translate() and cleared by the CLOCK hand in swap_out().
+#define PTE_SWAPPED    0x08
+#define PTE_REFERENCED 0x10
+
+// a PTE with PTE_COW maps a frame shared with a snapshot (see n_snapshot()).
+// reads go to the shared frame; the first write copies it.
+#define PTE_COW        0x20
+
 // -----------------------------------------------------------------------------
 //  Address Conversion Helpers (Provided)
 // -----------------------------------------------------------------------------
 
-static inline vaddr32_t VA2U(void *va)     { return (vaddr32_t)(uintptr_t)va; }
-static inline void*     U2VA(vaddr32_t u)  { return (void*)(uintptr_t)u; }
+static inline vaddr_t VA2U(void *va)     { return (vaddr_t)(uintptr_t)va; }
+static inline void*   U2VA(vaddr_t u)    { return (void*)(uintptr_t)u; }
 // -----------------------------------------------------------------------------
 //  TLB Configuration
 // -----------------------------------------------------------------------------
 
-#define TLB_ENTRIES   512   // Default number of TLB entries
+#define DEFAULT_TLB_ENTRIES 512   // Default number of TLB entries
+#define MIN_TLB_ENTRIES     16
+#define MAX_TLB_ENTRIES     4096
+#define TLB_WAYS      8     // Entries per set (associativity)
+#define TLB_ENTRIES   (vm_layout.tlb_entries)
+#define TLB_SETS      (vm_layout.tlb_sets)
+#define TLB_SET_BITS  (vm_layout.tlb_set_bits)
+#define MAX_TLB_SETS  (MAX_TLB_ENTRIES / TLB_WAYS)
+
+// note: the TLB is N-way set-associative. a VPN hashes to exactly one set and
+// may live in any of that set's ways, so a lookup only probes TLB_WAYS slots.
+// lookups take no lock and write nothing shared: every set carries a sequence
+// number, odd while a writer (under lock) changes it, and a probe that saw it
+// change retries. recency is approximate: a hit sets the way's referenced bit
+// only while it is clear, and when a set is full a CLOCK hand evicts the first
+// way not referenced since the hand last passed it.
+// a superpage is cached once, under TLB_LARGE_TAG | its superpage number
+// (va >> PDXSHIFT), rather than per page.
+// every entry also carries the ASID of its address space, and only matches
+// lookups made from that space. tlb_store is sized for MAX_TLB_ENTRIES; only
+// the first TLB_SETS sets are used. each set is laid out contiguously: the
+// fields a probe compares (seq through vpn) fill its first 64-byte cache line
+// with 32-bit addresses and its first two with 48-bit ones, so a probe
+// touches the same few lines whatever the TLB size.
+#if VA_BITS == 32
+#define TLB_LARGE_TAG (1u << 31)
+#else
+#define TLB_LARGE_TAG (1ull << 63)
+#endif
+struct tlb_set {
+  uint32_t seq;
+  bool in_use[TLB_WAYS];
+  uint16_t asid[TLB_WAYS];
+  vaddr_t vpn[TLB_WAYS];
+  pte_t* pte[TLB_WAYS];
+  bool prefetched[TLB_WAYS];   // preloaded by the prefetcher
+  bool referenced[TLB_WAYS];   // hit since the CLOCK hand last passed
+  uint8_t hand;
+} __attribute__((aligned(64)));
+
+#if VA_BITS == 32
+_Static_assert(offsetof(struct tlb_set, pte) <= 64, "TLB probe fields exceed one cache line");
+#else
+_Static_assert(offsetof(struct tlb_set, pte) <= 128, "TLB probe fields exceed two cache lines");
+#endif
 
 struct tlb {
-  uint32_t vpn[TLB_ENTRIES];
-  pte_t* pte[TLB_ENTRIES];
-  bool in_use[TLB_ENTRIES];
-  uint32_t last_used[TLB_ENTRIES];
+  struct tlb_set sets[MAX_TLB_SETS];
 };
 
 extern struct tlb tlb_store;
 
+// each thread also keeps a small direct-mapped private TLB (L1) in front of
+// tlb_store. L1 hits touch no shared state; n_free()/map_page() invalidate
+// every thread's L1 at once by bumping a global shootdown generation.
+#define L1_TLB_ENTRIES 32   // Per-thread private TLB entries (power of 2)
+
+// translate() watches each thread's L1 misses for a constant stride of up to
+// TLB_PREFETCH_MAX_STRIDE pages (either direction). once two misses in a row
+// are one stride apart, the translations of the next TLB_PREFETCH_DEPTH pages
+// along the stride are kept preloaded in tlb_store.
+#define TLB_PREFETCH_DEPTH       4
+#define TLB_PREFETCH_MAX_STRIDE  64
+
+// -----------------------------------------------------------------------------
+//  Address Space Configuration
+// -----------------------------------------------------------------------------
+
+// each address space owns a page directory and a v_bmap; frames, swap and
+// the TLBs are shared. a thread works in one space at a time and starts in
+// the root space (ASID 0). ASIDs are stored in the offset bits of a page
+// address, so there can be at most PGSIZE of them.
+#define MAX_ASIDS 256
+
+struct vm_space;
+
+// -----------------------------------------------------------------------------
+//  Frame Allocator Configuration
+// -----------------------------------------------------------------------------
+
+// every thread caches up to FRAME_MAG_SIZE reserved frames; refills and
+// drains move FRAME_MAG_BATCH frames between the cache and p_bmap at once
+#define FRAME_MAG_SIZE  64
+#define FRAME_MAG_BATCH 32
+
+// -----------------------------------------------------------------------------
+//  Small Object Configuration
+// -----------------------------------------------------------------------------
+
+// n_malloc_small() serves requests of up to SLAB_MAX_SIZE bytes from power of
+// two size classes, carving objects out of SLAB_SIZE slabs of lazily backed
+// pages, so a page only gets a frame once an object on it is touched. every
+// thread caches up to OBJ_MAG_SIZE free objects per class; refills and drains
+// move OBJ_MAG_BATCH objects between the cache and the slabs at once.
+#define SLAB_MIN_SHIFT  3
+#define SLAB_MIN_SIZE   (1u << SLAB_MIN_SHIFT)   // 8 B
+#define SLAB_MAX_SIZE   2048u
+#define SLAB_CLASSES    9                        // 8 B, 16 B, ..., 2 KB
+#define SLAB_SIZE       (64u * 1024)             // at least one page of any size
+#define SLAB_PAGES      (SLAB_SIZE / PGSIZE)
+#define OBJ_MAG_SIZE    64
+#define OBJ_MAG_BATCH   32
+
+// -----------------------------------------------------------------------------
+//  Swap Configuration
+// -----------------------------------------------------------------------------
+
+// once the frame pool is exhausted, the allocator evicts single pages to a swap
+// file instead of failing. victims are chosen by a CLOCK hand over the frames
+// (second chance through PTE_REFERENCED); superpages, page tables and pinned
+// frames stay resident. the file is created on first eviction, in $TMPDIR or
+// SWAP_DIR, and unlinked right away, so it disappears with the process.
+#define SWAP_SLOTS      MAX_NUM_FRAMES        // swap capacity, in pages
+#define SWAP_DIR        "/tmp"                // used when $TMPDIR is unset
+#define SWAP_FILE_TMPL  "my_vm.swap.XXXXXX"   // mkstemp() template
+
+// -----------------------------------------------------------------------------
+//  Startup Configuration
+// -----------------------------------------------------------------------------
+
+// set_physical_mem() only maps memory: the frame pool and the per-frame
+// metadata are committed a page at a time on first touch, so startup costs
+// the same for any MEMSIZE. vm_init() runs it ahead of the first allocation
+// and, with prefault set, populates the pool from a background thread in
+// PREFAULT_CHUNK steps. it also fixes the memory layout; a zero field
+// keeps its default.
+#define PREFAULT_CHUNK  (4u * 1024 * 1024)
+
+struct vm_config {
+  bool prefault;         // fault the frame pool in from a background thread
+  uint32_t pgsize;       // power of 2 in [MIN_PGSIZE, MAX_PGSIZE]
+  uint64_t memsize;      // multiple of SUPERPAGE_SIZE, up to MAX_PHYS_MEMSIZE
+  uint32_t pdx_bits;     // directory index bits (default: half the vpn, rounded
+                         // down); PTX_BITS gets the rest, at least MIN_PTX_BITS.
+                         // with 48-bit addresses, a page table fills a frame
+                         // and the two upper levels split what remains
+  uint32_t tlb_entries;  // power of 2 in [MIN_TLB_ENTRIES, MAX_TLB_ENTRIES]
+};
+
+// -----------------------------------------------------------------------------
+//  Persistent Image Configuration
+// -----------------------------------------------------------------------------
+
+// vm_attach() maps an image file over simulated memory: one header page, the
+// frame pool (which holds the root space's page directory and page tables),
+// then the root space's v_bmap. the header records the magic, version and
+// memory layout below, and only a process using the same ones reattaches it.
+// p_bmap and the per-frame counters are rebuilt from the page tables.
+#define IMAGE_MAGIC     0x31474d494d56594dull   // "MYVMIMG1"
+#define IMAGE_VERSION   2
+
+// -----------------------------------------------------------------------------
+//  Data Movement Configuration
+// -----------------------------------------------------------------------------
+
+// put_data()/get_data() copy without any lock, so copies to disjoint pages
+// run in parallel. the *_locked variants serialize on a stripe lock chosen by
+// physical frame, which makes any update that stays within one page atomic
+// with respect to other locked copies.
+#define COPY_LOCK_STRIPES 256
+
+// a pinned virtual range resolved to host memory by n_pin(). segs holds the
+// physically contiguous pieces of the range in virtual address order; the
+// frames behind them are neither freed nor remapped until n_unpin().
+struct vm_seg {
+  void* ptr;
+  uint32_t len;
+};
+
+struct vm_span {
+  struct vm_seg* segs;
+  uint32_t nsegs;
+};
+
+// one element of a put_datav()/get_datav() batch: len bytes between virtual
+// address va and host buffer buf. a batch is copied grouped by page,
+// translating every page it touches once; elements that overlap in
+// simulated memory are only written in batch order within one page.
+struct vm_iovec {
+  void* va;
+  void* buf;
+  uint32_t len;
+};
+
+// -----------------------------------------------------------------------------
+//  Statistics
+// -----------------------------------------------------------------------------
+
+// counters are kept per thread and summed by vm_get_stats(), so counting
+// costs the hot paths no shared writes. page counts are sampled on read.
+struct vm_stats {
+  unsigned long long tlb_lookups;    // l1_hits + tlb_hits + tlb_misses
+  unsigned long long l1_hits;        // hits in a thread's private TLB
+  unsigned long long tlb_hits;       // hits in the shared TLB
+  unsigned long long tlb_misses;
+  unsigned long long tlb_evictions;
+  // prefetcher accuracy is tlb_prefetch_hits / tlb_prefetches, its coverage
+  // tlb_prefetch_hits / (tlb_prefetch_hits + tlb_misses)
+  unsigned long long tlb_prefetches;     // translations preloaded
+  unsigned long long tlb_prefetch_hits;  // lookups answered by one of them
+  unsigned long long pgtbl_walks;
+  unsigned long long bytes_read;     // copied out by get_data() and friends
+  unsigned long long bytes_written;  // copied in by put_data() and friends
+
+  uint32_t frames_total;
+  uint32_t frames_used;              // data frames, page tables and directories
+  uint32_t frames_free;              // free in p_bmap or cached by a thread
+  uint32_t swap_pages;               // pages currently held in swap
+
+  // virtual pages of the calling thread's current address space
+  uint32_t va_pages_free;
+  uint32_t va_largest_free;          // longest run of free pages
+  double va_fragmentation;           // 1 - largest run / free pages
+};
+
 // -----------------------------------------------------------------------------
 //  Function Prototypes
 // -----------------------------------------------------------------------------
@@ -104,7 +425,55 @@ extern struct tlb tlb_store;
 void set_physical_mem(void);
 
 /*
- * Adds a new virtual-to-physical translation to the TLB.
+ * Initializes memory now instead of on first use, with the layout in config
+ * (NULL for the defaults). Must come before any other call into the library.
+ * Return: 0 on success, -1 if memory is already initialized or config is
+ * invalid.
+ */
+int vm_init(const struct vm_config *config);
+
+/*
+ * Backs simulated memory with an image file, creating it if absent, laid
+ * out as config asks (NULL for the defaults; see vm_init()). Must come
+ * before any other call, and an image only reattaches with the layout it
+ * was created with. A restored image brings back the pages of the root
+ * space as vm_detach() left them; small objects are freed by vm_detach(),
+ * not persisted.
+ * Return: 1 if an image was restored, 0 if a new one was made, -1 on failure.
+ */
+int vm_attach(const char *path, const struct vm_config *config);
+
+/*
+ * Writes the attached image out and marks it clean for the next vm_attach().
+ * Nothing may run concurrently, and the library is not used afterwards.
+ * Return: 0 on success, -1 on failure (the image stays unclean).
+ */
+int vm_detach(void);
+
+/*
+ * Creates an empty address space sharing the frame pool with all others.
+ * Return: the new space; NULL if out of ASIDs or memory.
+ */
+struct vm_space *vm_space_create(void);
+
+/*
+ * Makes space (NULL for the root space) the calling thread's current address
+ * space, which n_malloc(), put_data() etc. then work on. Flushes no TLB.
+ * Return: the previously current space.
+ */
+struct vm_space *vm_space_switch(struct vm_space *space);
+
+/*
+ * Frees an address space and everything still mapped in it. No thread may be
+ * using it; the root space and the caller's current space cannot be freed.
+ * Return: 0 on success, -1 on failure.
+ */
+int vm_space_destroy(struct vm_space *space);
+
+/*
+ * Adds a new virtual-to-physical translation to the TLB. If the target set
+ * is full, its CLOCK hand clears the referenced bit of each way it passes
+ * and evicts the first way not hit since the hand last went by.
  * Return: 0 on success, -1 on failure.
  */
 int TLB_add(void *va, void *pa);
@@ -121,9 +490,16 @@ pte_t *TLB_check(void *va);
  */
 void print_TLB_missrate(void);
 
+/*
+ * Takes a snapshot of the library's statistics; cheap enough to poll.
+ * Return: None.
+ */
+void vm_get_stats(struct vm_stats *out);
+
 /*
  * Translates a virtual address to a physical address.
- * Return: pointer to PTE if successful; NULL otherwise.
+ * Return: pointer to PTE if successful (for a superpage, to its PDE, which
+ *         has PDE_LARGE set); NULL otherwise.
  */
 pte_t *translate(pde_t *pgdir, void *va);
 
@@ -145,12 +521,31 @@ void *get_next_avail(int num_pages);
  */
 void *n_malloc(unsigned int num_bytes);
 
+/*
+ * Like n_malloc(), but pages get their frames on first access only.
+ * Return: pointer to base virtual address on success; NULL on failure.
+ */
+void *n_malloc_lazy(unsigned int num_bytes);
+
 /*
  * Frees one or more pages of memory starting from the given virtual address.
  * Return: None.
  */
 void n_free(void *va, int size);
 
+/*
+ * Allocates num_bytes (at most SLAB_MAX_SIZE) from a size class, sharing
+ * pages with other small objects. The object is aligned to its class size.
+ * Return: virtual address of the object on success; NULL on failure.
+ */
+void *n_malloc_small(unsigned int num_bytes);
+
+/*
+ * Frees an object from n_malloc_small(); its size is looked up, not passed.
+ * Return: None.
+ */
+void n_free_small(void *va);
+
 /*
  * Copies data from a user buffer into simulated physical memory
  * through a virtual address.
@@ -164,9 +559,56 @@ int put_data(void *va, void *val, int size);
  */
 void get_data(void *va, void *val, int size);
 
+/*
+ * Like put_data(), but each page touched is written under its stripe lock.
+ * Return: 0 on success, -1 on failure.
+ */
+int put_data_locked(void *va, void *val, int size);
+
+/*
+ * Like get_data(), but each page touched is read under its stripe lock.
+ * Return: None.
+ */
+void get_data_locked(void *va, void *val, int size);
+
+/*
+ * Copies a batch of host buffers into simulated memory (scatter).
+ * Return: 0 on success, -1 on failure (some elements may be written).
+ */
+int put_datav(const struct vm_iovec *iov, int cnt);
+
+/*
+ * Copies a batch of pieces of simulated memory into host buffers (gather).
+ * Return: 0 on success, -1 on failure.
+ */
+int get_datav(const struct vm_iovec *iov, int cnt);
+
+/*
+ * Pins the frames behind [va, va + len) and describes them as host memory
+ * segments, for direct access without per-element translation.
+ * Return: 0 on success, -1 on failure (nothing is pinned then). Fails in a
+ * read-only space, since the segments are writable.
+ */
+int n_pin(void *va, unsigned int len, struct vm_span *span);
+
+/*
+ * Releases a span filled by n_pin().
+ * Return: None.
+ */
+void n_unpin(struct vm_span *span);
+
+/*
+ * Clones the current address space into a new, read-only one that shares
+ * all frames copy-on-write; only page tables are copied.
+ * Return: the snapshot space; NULL on failure.
+ */
+struct vm_space *n_snapshot(void);
+
 /*
  * Performs matrix multiplication using data stored in simulated memory.
- * Each element should be accessed via get_data() and stored via put_data().
+ * The inputs are read out once and the answer is written through a pinned
+ * span by a tiled kernel; an answer overlapping an input, or a matrix that
+ * is not fully mapped, falls back to per-element get_data()/put_data().
  * Return: None.
  */
 void mat_mult(void *mat1, void *mat2, int size, void *answer);
@@ -175,9 +617,6 @@ void mat_mult(void *mat1, void *mat2, int size, void *answer);
 // Helper Functions
 // -----------------------------------------------------------------------------
 
-static void* alloc_frame();
-static int copy_data(void* va, void* val, int size, int dir);
-//
 // bitmap getters/setters
 void set_bit(char* bmap, int idx);
 int get_bit(char* bmap, int idx);